@@ -0,0 +1,101 @@
+/* miniexpect benchmarks
+ * Copyright (C) 2014-2022 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Benchmark the throughput of mexp_expect reading a large output
+ * from a subprocess, for a range of read sizes, with and without
+ * draining.  One regexp has partial matches open at the end of most
+ * reads, which is the expensive case.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "miniexpect.h"
+#include "tests.h"
+#include "bench.h"
+
+#define OUTPUT_SIZE (16 * 1024 * 1024)
+
+static const size_t read_sizes[] = { 256, 1024, 4096, 16384, 65536 };
+
+static const struct {
+  const char *name;
+  unsigned flags;
+} modes[] = {
+  { "plain", 0 },
+  { "jit", MEXP_EXPECT_JIT },
+  { "drain", MEXP_EXPECT_DRAIN },
+  { "jit+drain", MEXP_EXPECT_JIT|MEXP_EXPECT_DRAIN },
+};
+
+int
+main (void)
+{
+  long i, n = bench_iterations (3);
+  size_t j, k;
+  int64_t start, ns;
+  int r;
+  mexp_h *h;
+  char cmd[256], params[128];
+  pcre2_code *done_re = test_compile_re ("(?m)^done$");
+  pcre2_code *partial_re = test_compile_re ("abc[0-9]{8}Z");
+  pcre2_match_data *match_data = pcre2_match_data_create (4, NULL);
+  const mexp_regexp regexps[] = {
+    { 1, .re = done_re },
+    { 2, .re = partial_re },
+    { 0 },
+  };
+
+  snprintf (cmd, sizeof cmd,
+            "yes 'abc1234567 some filler text' | head -c %d; echo; echo done",
+            OUTPUT_SIZE);
+
+  for (k = 0; k < sizeof modes / sizeof modes[0]; ++k) {
+    for (j = 0; j < sizeof read_sizes / sizeof read_sizes[0]; ++j) {
+      ns = 0;
+      for (i = 0; i < n; ++i) {
+        h = mexp_spawnl ("sh", "sh", "-c", cmd, NULL);
+        assert (h != NULL);
+        mexp_set_read_size (h, read_sizes[j]);
+        mexp_set_max_buffer_size (h, 256 * 1024);
+        mexp_set_expect_flags (h, modes[k].flags);
+        start = bench_now_ns ();
+        r = mexp_expect (h, regexps, match_data);
+        ns += bench_now_ns () - start;
+        assert (r == 1);
+        mexp_close (h);
+      }
+      snprintf (params, sizeof params,
+                "\"mode\":\"%s\",\"read_size\":%zu",
+                modes[k].name, read_sizes[j]);
+      bench_report ("expect-throughput", params, n, ns,
+                    (uint64_t) n * OUTPUT_SIZE);
+    }
+  }
+
+  pcre2_code_free (done_re);
+  pcre2_code_free (partial_re);
+  pcre2_match_data_free (match_data);
+
+  exit (EXIT_SUCCESS);
+}
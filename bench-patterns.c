@@ -0,0 +1,133 @@
+/* miniexpect benchmarks
+ * Copyright (C) 2014-2022 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Benchmark how matching scales with the number of regexps.  The
+ * output is recorded once and then replayed at full speed, so only
+ * the matcher is measured.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "miniexpect.h"
+#include "tests.h"
+#include "bench.h"
+
+#define OUTPUT_SIZE (4 * 1024 * 1024)
+#define MAX_PATTERNS 64
+
+static const struct {
+  const char *name;
+  unsigned flags;
+} modes[] = {
+  { "plain", 0 },
+  { "jit", MEXP_EXPECT_JIT },
+  { "dfa", MEXP_EXPECT_DFA },
+  { "prefilter", MEXP_EXPECT_PREFILTER },
+  { "jit+prefilter", MEXP_EXPECT_JIT|MEXP_EXPECT_PREFILTER },
+};
+
+/* Record a session to a temporary file. */
+static void
+record (FILE *rec, const mexp_regexp *regexps, pcre2_match_data *match_data)
+{
+  char cmd[256];
+  mexp_h *h;
+  int r;
+
+  snprintf (cmd, sizeof cmd,
+            "yes 'pat17 line of output with pat in it' | head -c %d; "
+            "echo; echo done",
+            OUTPUT_SIZE);
+  h = mexp_spawnl ("sh", "sh", "-c", cmd, NULL);
+  assert (h != NULL);
+  mexp_set_read_size (h, 4096);
+  assert (mexp_start_recording (h, fileno (rec)) == 0);
+  r = mexp_expect (h, regexps, match_data);
+  assert (r == 1);
+  mexp_close (h);
+}
+
+int
+main (void)
+{
+  long i, n = bench_iterations (5);
+  size_t j, k, nr;
+  int64_t start, ns;
+  int r;
+  mexp_h *h;
+  FILE *rec;
+  char filename[64], params[128], rex[64];
+  pcre2_code *res[MAX_PATTERNS+1];
+  mexp_regexp regexps[MAX_PATTERNS+2];
+  pcre2_match_data *match_data = pcre2_match_data_create (4, NULL);
+
+  /* Regexps which never match, but often partly match. */
+  res[0] = test_compile_re ("(?m)^done$");
+  for (j = 1; j <= MAX_PATTERNS; ++j) {
+    snprintf (rex, sizeof rex, "pat%zu[0-9]+:", j);
+    res[j] = test_compile_re (rex);
+  }
+
+  rec = tmpfile ();
+  assert (rec != NULL);
+  snprintf (filename, sizeof filename, "/dev/fd/%d", fileno (rec));
+  regexps[0] = (mexp_regexp) { 1, .re = res[0] };
+  regexps[1] = (mexp_regexp) { 0 };
+  record (rec, regexps, match_data);
+
+  for (k = 0; k < sizeof modes / sizeof modes[0]; ++k) {
+    for (nr = 1; nr <= MAX_PATTERNS; nr *= 2) {
+      /* The regexp which matches is last, so all are tried. */
+      for (j = 0; j < nr; ++j)
+        regexps[j] = (mexp_regexp) { (int) j + 2, res[j+1], 0 };
+      regexps[nr] = (mexp_regexp) { 1, res[0], 0 };
+      regexps[nr+1] = (mexp_regexp) { 0 };
+
+      ns = 0;
+      for (i = 0; i < n; ++i) {
+        h = mexp_replay_open (filename, 0);
+        assert (h != NULL);
+        mexp_set_read_size (h, 4096);
+        mexp_set_max_buffer_size (h, 256 * 1024);
+        mexp_set_expect_flags (h, modes[k].flags);
+        start = bench_now_ns ();
+        r = mexp_expect (h, regexps, match_data);
+        ns += bench_now_ns () - start;
+        assert (r == 1);
+        mexp_close (h);
+      }
+      snprintf (params, sizeof params, "\"mode\":\"%s\",\"patterns\":%zu",
+                modes[k].name, nr);
+      bench_report ("expect-patterns", params, n, ns,
+                    (uint64_t) n * OUTPUT_SIZE);
+    }
+  }
+
+  fclose (rec);
+  for (j = 0; j <= MAX_PATTERNS; ++j)
+    pcre2_code_free (res[j]);
+  pcre2_match_data_free (match_data);
+
+  exit (EXIT_SUCCESS);
+}
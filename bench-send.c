@@ -0,0 +1,99 @@
+/* miniexpect benchmarks
+ * Copyright (C) 2014-2022 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Benchmark the cost of sending to a subprocess with each of the
+ * send functions, for a range of message sizes.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <assert.h>
+
+#include "miniexpect.h"
+#include "tests.h"
+#include "bench.h"
+
+static const size_t sizes[] = { 16, 256, 4096 };
+
+enum method { SEND, SENDV, PRINTF };
+static const char *method_names[] = { "send", "sendv", "printf" };
+
+int
+main (void)
+{
+  long i, n = bench_iterations (20000);
+  size_t j;
+  int m;
+  int64_t start, ns;
+  mexp_h *h;
+  char *msg, params[128];
+  struct iovec iov[4];
+
+  /* The subprocess throws away what we send as fast as it can. */
+  h = mexp_spawnl ("sh", "sh", "-c", "exec cat > /dev/null", NULL);
+  assert (h != NULL);
+
+  for (m = SEND; m <= PRINTF; ++m) {
+    for (j = 0; j < sizeof sizes / sizeof sizes[0]; ++j) {
+      msg = malloc (sizes[j] + 1);
+      assert (msg != NULL);
+      memset (msg, 'a', sizes[j] - 1);
+      msg[sizes[j] - 1] = '\n';
+      msg[sizes[j]] = '\0';
+      /* The same message, in four parts. */
+      iov[0].iov_base = msg;
+      iov[0].iov_len = sizes[j] / 4;
+      iov[1].iov_base = msg + iov[0].iov_len;
+      iov[1].iov_len = sizes[j] / 4;
+      iov[2].iov_base = msg + 2 * iov[0].iov_len;
+      iov[2].iov_len = sizes[j] / 4;
+      iov[3].iov_base = msg + 3 * iov[0].iov_len;
+      iov[3].iov_len = sizes[j] - 3 * iov[0].iov_len;
+
+      start = bench_now_ns ();
+      for (i = 0; i < n; ++i) {
+        switch (m) {
+        case SEND:
+          assert (mexp_send (h, msg, sizes[j]) == (ssize_t) sizes[j]);
+          break;
+        case SENDV:
+          assert (mexp_sendv (h, iov, 4) == (ssize_t) sizes[j]);
+          break;
+        case PRINTF:
+          assert (mexp_printf (h, "%s", msg) == (int) sizes[j]);
+          break;
+        }
+      }
+      ns = bench_now_ns () - start;
+
+      snprintf (params, sizeof params, "\"method\":\"%s\",\"size\":%zu",
+                method_names[m], sizes[j]);
+      bench_report ("send", params, n, ns, (uint64_t) n * sizes[j]);
+      free (msg);
+    }
+  }
+
+  mexp_close (h);
+
+  exit (EXIT_SUCCESS);
+}
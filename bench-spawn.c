@@ -0,0 +1,108 @@
+/* miniexpect benchmarks
+ * Copyright (C) 2014-2022 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Benchmark the latency from spawning a subprocess to reading its
+ * first byte of output, directly, through the spawn server and from
+ * a pty pool.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "miniexpect.h"
+#include "tests.h"
+#include "bench.h"
+
+static char *echo_argv[] = { "echo", "x", NULL };
+
+static void
+first_byte (mexp_h *h, const mexp_regexp *regexps,
+            pcre2_match_data *match_data)
+{
+  int r;
+
+  assert (h != NULL);
+  r = mexp_expect (h, regexps, match_data);
+  assert (r == 1);
+}
+
+int
+main (void)
+{
+  long i, n = bench_iterations (200);
+  int64_t start, ns;
+  mexp_h *h;
+  mexp_server *server;
+  mexp_pty_pool *pool;
+  pcre2_code *re = test_compile_re ("x");
+  pcre2_match_data *match_data = pcre2_match_data_create (4, NULL);
+  const mexp_regexp regexps[] = {
+    { 1, .re = re },
+    { 0 },
+  };
+
+  mexp_set_handle_cache_size (8);
+
+  ns = 0;
+  for (i = 0; i < n; ++i) {
+    start = bench_now_ns ();
+    h = mexp_spawnv ("echo", echo_argv);
+    first_byte (h, regexps, match_data);
+    ns += bench_now_ns () - start;
+    mexp_close (h);
+  }
+  bench_report ("spawn-first-byte", "\"mode\":\"direct\"", n, ns, 0);
+
+  server = mexp_server_start ();
+  assert (server != NULL);
+  ns = 0;
+  for (i = 0; i < n; ++i) {
+    start = bench_now_ns ();
+    h = mexp_server_spawnv (server, "echo", echo_argv);
+    first_byte (h, regexps, match_data);
+    ns += bench_now_ns () - start;
+    mexp_close (h);
+  }
+  bench_report ("spawn-first-byte", "\"mode\":\"server\"", n, ns, 0);
+  mexp_server_stop (server);
+
+  /* Opening the ptys is taken out of the timing by the pool. */
+  pool = mexp_pty_pool_create (16);
+  assert (pool != NULL);
+  ns = 0;
+  for (i = 0; i < n; ++i) {
+    assert (mexp_pty_pool_fill (pool) == 0);
+    start = bench_now_ns ();
+    h = mexp_pool_spawnvf (pool, 0, "echo", echo_argv);
+    first_byte (h, regexps, match_data);
+    ns += bench_now_ns () - start;
+    mexp_close (h);
+  }
+  bench_report ("spawn-first-byte", "\"mode\":\"pool\"", n, ns, 0);
+  mexp_pty_pool_free (pool);
+
+  pcre2_code_free (re);
+  pcre2_match_data_free (match_data);
+
+  exit (EXIT_SUCCESS);
+}
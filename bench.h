@@ -0,0 +1,74 @@
+/* miniexpect benchmarks
+ * Copyright (C) 2014-2022 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+
+static inline int64_t
+bench_now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Scale the default number of iterations by $MEXP_BENCH_SCALE, so
+ * the benchmarks can be run for longer to get steadier results.
+ */
+__attribute__((__unused__))
+static long
+bench_iterations (long n)
+{
+  const char *s = getenv ("MEXP_BENCH_SCALE");
+  double scale;
+
+  if (s == NULL || (scale = atof (s)) <= 0)
+    return n;
+  n *= scale;
+  return n > 0 ? n : 1;
+}
+
+/* Print one result as a line of JSON.  params is a JSON fragment
+ * with the parameters of this run, eg. "\"read_size\":1024".  If
+ * bytes is non-zero, the throughput is printed too.
+ */
+__attribute__((__unused__))
+static void
+bench_report (const char *name, const char *params,
+              long iterations, int64_t ns, uint64_t bytes)
+{
+  printf ("{\"bench\":\"%s\",\"version\":\"%s\"", name, PACKAGE_VERSION);
+  if (params && *params)
+    printf (",%s", params);
+  printf (",\"iterations\":%ld,\"ns\":%" PRId64 ",\"ns_per_op\":%.1f",
+          iterations, ns, (double) ns / iterations);
+  if (bytes > 0)
+    printf (",\"bytes\":%" PRIu64 ",\"mb_per_s\":%.2f",
+            bytes, bytes / 1e6 / (ns / 1e9));
+  printf ("}\n");
+  fflush (stdout);
+}
+
+#endif /* BENCH_H_ */
@@ -21,6 +21,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <limits.h>
 #include <string.h>
 #include <ctype.h>
 #include <fcntl.h>
@@ -31,365 +33,4478 @@
 #include <termios.h>
 #include <time.h>
 #include <assert.h>
+#include <spawn.h>
+#include <pthread.h>
 #include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#endif
 
 #define PCRE2_CODE_UNIT_WIDTH 8
 #include <pcre2.h>
 
 #include "miniexpect.h"
 
-static void debug_buffer (FILE *, const char *);
+/* USDT probes for SystemTap, perf and bpftrace.  These compile to a
+ * nop when not being traced.  See "TRACING" in the manual for the
+ * list of probes.
+ */
+#ifdef HAVE_SYS_SDT_H
+#define PROBE3(name, a, b, c) DTRACE_PROBE3 (miniexpect, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4 (miniexpect, name, a, b, c, d)
+#else
+#define PROBE3(name, a, b, c) do { } while (0)
+#define PROBE4(name, a, b, c, d) do { } while (0)
+#endif
+
+/* The library's own state for each handle.  It is kept out of
+ * struct mexp_h so that adding to it doesn't change the layout of the
+ * public structure.
+ */
+struct mexp_handle_private {
+  size_t *re_start;             /* per-regexp offset to resume matching */
+  size_t nr_re_start;           /* allocated length of re_start */
+  struct mexp_re_info *re_info; /* per-regexp, for the current expect */
+  uint64_t re_start_id;         /* patterns re_start belongs to, or 0 */
+  pcre2_match_context *match_context; /* used with MEXP_EXPECT_JIT */
+  pcre2_jit_stack *jit_stack;
+  int *dfa_workspace;           /* used with MEXP_EXPECT_DFA */
+  size_t nr_dfa_workspace;
+  struct mexp_prefilter *prefilter; /* used with MEXP_EXPECT_PREFILTER */
+  const struct mexp_prefilter *active_prefilter; /* for this expect */
+  unsigned char *re_run;        /* per-regexp flag: prefilter says run it */
+  size_t prefilter_pos;         /* bytes of buffer scanned by prefilter */
+  int prefilter_state;          /* prefilter automaton state */
+  int buffer_trimmed;           /* start of buffer was dropped */
+  size_t line_scanned;          /* MEXP_EXPECT_LINES: searched for \n */
+  size_t drain_read_size;       /* MEXP_EXPECT_DRAIN: adaptive read size */
+  int64_t deadline;             /* CLOCK_MONOTONIC ns, or -1 if none */
+  struct mexp_server *server;   /* spawned by server, or NULL */
+  struct mexp_set_entry *set_entry; /* in a mexp_set, or NULL */
+  int nonblocking;              /* fd has O_NONBLOCK set */
+  int stepping;                 /* between expect_start and result */
+  const struct mexp_regexp *step_regexps;
+  pcre2_match_data *step_match_data;
+  int64_t step_end;             /* timeout of step, or -1 */
+  int step_more;                /* last step stopped with more to read */
+  char *outq;                   /* outgoing queue */
+  size_t outq_start, outq_len, outq_alloc;
+  int record_fd;                /* recording, or -1 */
+  int64_t record_last;          /* time of last recorded frame */
+  struct mexp_replay *replay;   /* replaying a recording, or NULL */
+  struct mexp_stats stats;
+  int64_t expect_started;       /* when the current expect began */
+  struct mexp_histogram *histograms;
+  size_t nr_histograms, alloc_histograms;
+  mexp_log_callback log_cb;
+  void *log_opaque;
+  unsigned log_rate, log_burst; /* rate limit, or 0 if none */
+  double log_tokens;
+  int64_t log_refilled;         /* when log_tokens was last updated */
+  uint64_t log_dropped;
+  struct mexp_runner_session *runner_session; /* in a runner, or NULL */
+  const struct mexp_patterns *patterns; /* used by the current expect */
+  pcre2_match_data *patterns_match_data; /* if the caller passed NULL */
+};
+
+static void debug_buffer (FILE *, const char *, size_t);
+static void prefilter_free (struct mexp_prefilter *pf);
+static int server_wait (mexp_server *server, pid_t pid);
+static void set_detach (mexp_h *h);
+static void set_update_handle (mexp_h *h);
+static void send_queued (mexp_h *h);
+static void replay_free (struct mexp_replay *rp);
+static int set_nonblocking (mexp_h *h);
+static pcre2_match_context *get_jit_match_context (mexp_h *h);
+static int select_prefilter (mexp_h *h, const mexp_regexp *regexps);
+
+/* If the caller asks for it with mexp_set_handle_cache_size, handles
+ * (with their buffers and other memory) are kept in this small cache
+ * by mexp_close so they can be reused by the next spawn.  A program
+ * which spawns the same dialog repeatedly therefore does no heap
+ * allocations in the library once it has warmed up.  It is off by
+ * default because a handle used after mexp_close would then silently
+ * belong to another session.  The slots are accessed with atomic
+ * operations so this is thread safe.
+ */
+#define HANDLE_CACHE_SIZE 8
+#define MAX_CACHED_BUFFER (64 * 1024)
+static mexp_h *handle_cache[HANDLE_CACHE_SIZE];
+static size_t handle_cache_size;
+
+static void
+destroy_handle (mexp_h *h)
+{
+  free (h->buffer);
+  free (h->priv->re_start);
+  free (h->priv->re_run);
+  free (h->priv->re_info);
+  pcre2_match_context_free (h->priv->match_context);
+  pcre2_jit_stack_free (h->priv->jit_stack);
+  free (h->priv->dfa_workspace);
+  prefilter_free (h->priv->prefilter);
+  free (h->priv->outq);
+  free (h->priv->histograms);
+  pcre2_match_data_free (h->priv->patterns_match_data);
+  free (h->priv);
+  free (h);
+}
+
+/* Free the handles cached in slots from start onwards. */
+static void
+drop_cached_handles (size_t start)
+{
+  size_t i;
+
+  for (i = start; i < HANDLE_CACHE_SIZE; ++i) {
+    mexp_h *h = __atomic_exchange_n (&handle_cache[i], NULL, __ATOMIC_ACQUIRE);
+    if (h)
+      destroy_handle (h);
+  }
+}
+
+static void free_handle_cache (void) __attribute__((destructor));
+
+static void
+free_handle_cache (void)
+{
+  drop_cached_handles (0);
+}
+
+void
+mexp_set_handle_cache_size (size_t size)
+{
+  if (size > HANDLE_CACHE_SIZE)
+    size = HANDLE_CACHE_SIZE;
+  __atomic_store_n (&handle_cache_size, size, __ATOMIC_RELAXED);
+  drop_cached_handles (size);
+}
+
+static mexp_h *
+create_handle (void)
+{
+  mexp_h *h = NULL;
+  size_t i;
+
+  for (i = 0; h == NULL && i < HANDLE_CACHE_SIZE; ++i)
+    h = __atomic_exchange_n (&handle_cache[i], NULL, __ATOMIC_ACQUIRE);
+
+  if (h == NULL) {
+    h = malloc (sizeof *h);
+    if (h == NULL)
+      return NULL;
+    h->priv = malloc (sizeof *h->priv);
+    if (h->priv == NULL) {
+      free (h);
+      return NULL;
+    }
+
+    h->buffer = NULL;
+    h->alloc = 0;
+    h->priv->re_start = NULL;
+    h->priv->re_run = NULL;
+    h->priv->re_info = NULL;
+    h->priv->nr_re_start = 0;
+    h->priv->match_context = NULL;
+    h->priv->jit_stack = NULL;
+    h->priv->dfa_workspace = NULL;
+    h->priv->nr_dfa_workspace = 0;
+    h->priv->prefilter = NULL;
+    h->priv->outq = NULL;
+    h->priv->outq_alloc = 0;
+    h->priv->histograms = NULL;
+    h->priv->alloc_histograms = 0;
+    h->priv->patterns_match_data = NULL;
+  }
+
+  /* Initialize every field which isn't just memory to default
+   * values, so nothing from a cached handle's previous session
+   * leaks into this one.  The memory allocated by a cached handle is
+   * kept.
+   */
+  h->fd = -1;
+  h->pid = 0;
+  h->timeout = 60000;
+  h->read_size = 1024;
+  h->max_buffer_size = 0;
+  h->drain_max = 65536;
+  h->priv->drain_read_size = 0;
+  h->expect_flags = 0;
+  h->pcre_error = 0;
+  h->jit_used = 0;
+  h->len = 0;
+  h->next_match = -1;
+  h->debug_fp = NULL;
+  h->sink_fd = -1;
+  h->sink_error = h->record_error = 0;
+  h->user1 = h->user2 = h->user3 = NULL;
+  h->priv->active_prefilter = NULL;
+  h->priv->prefilter_pos = 0;
+  h->priv->prefilter_state = 0;
+  h->priv->buffer_trimmed = 0;
+  h->priv->line_scanned = 0;
+  h->priv->re_start_id = 0;
+  h->priv->deadline = -1;
+  h->priv->server = NULL;
+  h->priv->set_entry = NULL;
+  h->priv->nonblocking = 0;
+  h->priv->stepping = 0;
+  h->priv->step_regexps = NULL;
+  h->priv->step_match_data = NULL;
+  h->priv->step_end = -1;
+  h->priv->step_more = 0;
+  h->priv->outq_start = h->priv->outq_len = 0;
+  h->priv->record_fd = -1;
+  h->priv->record_last = 0;
+  h->priv->replay = NULL;
+  memset (&h->priv->stats, 0, sizeof h->priv->stats);
+  h->priv->expect_started = 0;
+  h->priv->nr_histograms = 0;
+  h->priv->log_cb = NULL;
+  h->priv->log_opaque = NULL;
+  h->priv->log_rate = h->priv->log_burst = 0;
+  h->priv->log_tokens = 0;
+  h->priv->log_refilled = 0;
+  h->priv->log_dropped = 0;
+  h->priv->runner_session = NULL;
+  h->priv->patterns = NULL;
+
+  return h;
+}
+
+static void
+free_handle (mexp_h *h)
+{
+  size_t i;
+
+  /* Don't keep very large buffers around. */
+  if (h->alloc > MAX_CACHED_BUFFER) {
+    free (h->buffer);
+    h->buffer = NULL;
+    h->alloc = 0;
+  }
+  if (h->priv->outq_alloc > MAX_CACHED_BUFFER) {
+    free (h->priv->outq);
+    h->priv->outq = NULL;
+    h->priv->outq_alloc = 0;
+  }
+
+  /* The prefilter is kept: it is keyed on the regexps it was built
+   * from, so the next session reuses it if it expects the same list.
+   * It is freed when the handle leaves the cache.
+   */
+
+  for (i = 0; i < __atomic_load_n (&handle_cache_size, __ATOMIC_RELAXED);
+       ++i) {
+    mexp_h *expected = NULL;
+
+    if (__atomic_compare_exchange_n (&handle_cache[i], &expected, h, 0,
+                                     __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      return;
+  }
+
+  destroy_handle (h);
+}
+
+/* Empty the buffer.  The memory is kept for the next read. */
+static void
+clear_buffer (mexp_h *h)
+{
+  h->len = 0;
+  if (h->buffer)
+    h->buffer[0] = '\0';
+  h->next_match = -1;
+  if (h->priv->nr_re_start > 0) {
+    memset (h->priv->re_start, 0, h->priv->nr_re_start * sizeof (size_t));
+    memset (h->priv->re_run, 0, h->priv->nr_re_start);
+  }
+  h->priv->prefilter_pos = 0;
+  h->priv->prefilter_state = 0;
+  h->priv->buffer_trimmed = 0;
+  h->priv->line_scanned = 0;
+}
+
+/* What the matching code needs to know about each regexp.  This is
+ * worked out at the start of each expect call, or once and for all by
+ * mexp_patterns_compile, so we don't have to ask PCRE2 after every
+ * read.
+ */
+struct mexp_re_info {
+  const char *literal;          /* literal pattern, or NULL */
+  size_t literal_len;
+  size_t lookbehind;            /* in bytes */
+  int first_cu;                 /* first code unit, or -1 if not known */
+  unsigned char anchored;
+  unsigned char jit;            /* JIT-compiled in all match modes */
+  unsigned char resumable;      /* see expect_begin */
+};
+
+/* Modes the regexps are JIT-compiled in: complete matches, and soft
+ * partial matches (used by the normal and line modes).
+ */
+#define JIT_COMPILE_OPTIONS \
+  (PCRE2_JIT_COMPLETE | PCRE2_JIT_PARTIAL_SOFT)
+
+/* Work out the information about a regexp.  literal is the string
+ * if it was added by mexp_patterns_add_literal, else NULL.  If jit is
+ * true, it is also JIT-compiled.  pcre2_jit_compile doesn't touch a
+ * regexp which is already compiled in these modes, so after the first
+ * time this is safe even if other threads are matching with the same
+ * regexp.
+ */
+static void
+re_info_init (struct mexp_re_info *info, const mexp_regexp *regexp,
+              const char *literal, int jit)
+{
+  uint32_t all_options = 0, lookbehind, type = 0, cu;
+
+  memset (info, 0, sizeof *info);
+  info->first_cu = -1;
+
+  if (literal) {
+    /* A literal string, which is searched for directly. */
+    info->literal = literal;
+    info->literal_len = strlen (literal);
+    info->resumable = 1;
+    return;
+  }
+
+  pcre2_pattern_info (regexp->re, PCRE2_INFO_ALLOPTIONS, &all_options);
+  if ((all_options | regexp->options) & PCRE2_ANCHORED)
+    info->anchored = 1;
+
+  if (pcre2_pattern_info (regexp->re, PCRE2_INFO_MAXLOOKBEHIND,
+                          &lookbehind) != 0)
+    info->lookbehind = SIZE_MAX;
+  /* The lookbehind is in characters, which in UTF-8 can be up to 4
+   * bytes each.
+   */
+  else if (all_options & PCRE2_UTF)
+    info->lookbehind = (size_t) lookbehind * 4;
+  else
+    info->lookbehind = lookbehind;
+
+  if (pcre2_pattern_info (regexp->re, PCRE2_INFO_FIRSTCODETYPE,
+                          &type) == 0 && type == 1 &&
+      pcre2_pattern_info (regexp->re, PCRE2_INFO_FIRSTCODEUNIT,
+                          &cu) == 0)
+    info->first_cu = cu;
+
+  /* A regexp with a fixed first code unit and no lookbehind can't
+   * look at any data before the start of the match.  (^ doesn't
+   * show up as a lookbehind, but ^ in an alternation leaves the
+   * first code unit unknown.)
+   */
+  info->resumable = !info->anchored && info->lookbehind == 0 && type == 1;
+
+  if (jit &&
+      pcre2_jit_compile ((pcre2_code *) regexp->re, JIT_COMPILE_OPTIONS) == 0)
+    info->jit = 1;
+}
+
+/* Make sure there is room for the per-regexp state of this list of
+ * regexps, and work out the information about each one, unless it
+ * was worked out by mexp_patterns_compile.
+ */
+static int
+prepare_regexps (mexp_h *h, const mexp_regexp *regexps)
+{
+  size_t i, n = 0;
+  int jit;
+
+  if (regexps) {
+    for (; regexps[n].r > 0; ++n) {
+      if (regexps[n].re == NULL) {
+        errno = EINVAL;
+        return -1;
+      }
+    }
+  }
+
+  if (n > h->priv->nr_re_start) {
+    size_t *new_re_start;
+    unsigned char *new_re_run;
+    struct mexp_re_info *new_re_info;
+
+    new_re_start = realloc (h->priv->re_start, n * sizeof (size_t));
+    if (new_re_start == NULL)
+      return -1;
+    h->priv->re_start = new_re_start;
+    new_re_run = realloc (h->priv->re_run, n);
+    if (new_re_run == NULL)
+      return -1;
+    h->priv->re_run = new_re_run;
+    new_re_info = realloc (h->priv->re_info, n * sizeof *new_re_info);
+    if (new_re_info == NULL)
+      return -1;
+    h->priv->re_info = new_re_info;
+    h->priv->nr_re_start = n;
+    /* Offsets for regexps we haven't seen before are not valid. */
+    h->priv->re_start_id = 0;
+  }
+
+  if (h->priv->patterns == NULL) {
+    jit = !(h->expect_flags & MEXP_EXPECT_DFA) &&
+      get_jit_match_context (h) != NULL;
+    for (i = 0; i < n; ++i)
+      re_info_init (&h->priv->re_info[i], &regexps[i], NULL, jit);
+  }
+
+  if (select_prefilter (h, regexps) == -1)
+    return -1;
+
+  h->priv->prefilter_pos = 0;
+  h->priv->prefilter_state = 0;
+  return 0;
+}
+
+/* Match options which don't prevent pcre2_match from using the JIT. */
+#define JIT_MATCH_OPTIONS \
+  (PCRE2_NOTBOL | PCRE2_NOTEOL | PCRE2_NOTEMPTY | PCRE2_NOTEMPTY_ATSTART | \
+   PCRE2_NO_UTF_CHECK | PCRE2_PARTIAL_SOFT)
+
+/* Test if a pcre2_match call with these options used the JIT.  The
+ * regexp was JIT-compiled at the start of the expect call, but if the
+ * JIT is not available or some of the options cannot be handled by
+ * it, pcre2_match silently uses the interpreter.
+ */
+static int
+jit_matched (mexp_h *h, const struct mexp_re_info *info, int options)
+{
+  return get_jit_match_context (h) != NULL && info->jit &&
+    (options & ~JIT_MATCH_OPTIONS) == 0;
+}
+
+/* A list of regexps compiled by mexp_patterns_compile, with what the
+ * matching code needs to know about each one worked out in advance.
+ * Once compiled it is read-only, so it can be shared between handles
+ * and threads.
+ */
+struct mexp_patterns {
+  size_t nr, alloc;
+  mexp_regexp *regexps;         /* nr entries, then a terminator */
+  char **literals;              /* nr entries, NULL if not a literal */
+  struct mexp_re_info *info;    /* nr entries */
+  uint64_t id;                  /* unique, assigned when compiled */
+  unsigned flags;               /* MEXP_EXPECT_* */
+  int compiled;
+  struct mexp_prefilter *prefilter; /* if MEXP_EXPECT_PREFILTER */
+  uint32_t ovecsize;            /* enough for every regexp */
+};
+
+/* Incremented to give each compiled mexp_patterns its id. */
+static uint64_t patterns_id;
+
+/* The expect flags to use: those the patterns were compiled with if
+ * expecting a mexp_patterns, else the handle's.
+ */
+static unsigned
+active_flags (mexp_h *h)
+{
+  return h->priv->patterns ? h->priv->patterns->flags : h->expect_flags;
+}
+
+/* The information about the regexps in the current expect call. */
+static const struct mexp_re_info *
+regexps_info (mexp_h *h)
+{
+  return h->priv->patterns ? h->priv->patterns->info : h->priv->re_info;
+}
+
+/* If MEXP_EXPECT_JIT is set, return the match context holding the
+ * per-handle JIT stack, creating it the first time.  Returns NULL if
+ * the JIT should not be used, which makes pcre2_match use the
+ * default context.
+ */
+static pcre2_match_context *
+get_jit_match_context (mexp_h *h)
+{
+  uint32_t jit;
+
+  if (!(active_flags (h) & MEXP_EXPECT_JIT))
+    return NULL;
+  if (h->priv->match_context)
+    return h->priv->match_context;
+
+  if (pcre2_config (PCRE2_CONFIG_JIT, &jit) != 0 || !jit)
+    return NULL;
+
+  h->priv->jit_stack = pcre2_jit_stack_create (32 * 1024, 1024 * 1024, NULL);
+  if (h->priv->jit_stack == NULL)
+    return NULL;
+  h->priv->match_context = pcre2_match_context_create (NULL);
+  if (h->priv->match_context == NULL) {
+    pcre2_jit_stack_free (h->priv->jit_stack);
+    h->priv->jit_stack = NULL;
+    return NULL;
+  }
+  pcre2_jit_stack_assign (h->priv->match_context, NULL, h->priv->jit_stack);
+  return h->priv->match_context;
+}
+
+/* Current CLOCK_MONOTONIC time in nanoseconds. */
+static int64_t
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void
+mexp_set_deadline_ms (mexp_h *h, int ms)
+{
+  if (ms < 0)
+    h->priv->deadline = -1;
+  else
+    h->priv->deadline = now_ns () + (int64_t) ms * 1000000;
+}
+
+int
+mexp_get_deadline_ms (mexp_h *h)
+{
+  int64_t ns;
+
+  if (h->priv->deadline == -1)
+    return -1;
+  ns = h->priv->deadline - now_ns ();
+  if (ns <= 0)
+    return 0;
+  /* Round up, so that waiting this long always reaches the deadline. */
+  return (ns + 999999) / 1000000;
+}
+
+int
+mexp_wait (mexp_h *h)
+{
+  int status;
+
+  if (h->pid <= 0) {
+    errno = ECHILD;
+    return -1;
+  }
+
+  if (h->priv->server != NULL)
+    status = server_wait (h->priv->server, h->pid);
+  else if (waitpid (h->pid, &status, 0) == -1)
+    status = -1;
+  h->pid = 0;
+
+  return status;
+}
+
+/* How long mexp_close waits for the subprocess to read the outgoing
+ * queue before giving up on it.
+ */
+#define CLOSE_FLUSH_MS 1000
+
+/* Give the subprocess a chance to read whatever is still queued,
+ * so that closing the pty doesn't silently drop it.  This waits for
+ * at most CLOSE_FLUSH_MS, or the handle's timeout if that is shorter.
+ */
+static void
+flush_before_close (mexp_h *h)
+{
+  int64_t end, now;
+  int ms;
+  struct pollfd pfd;
+
+  ms = CLOSE_FLUSH_MS;
+  if (h->timeout >= 0 && h->timeout < ms)
+    ms = h->timeout;
+  end = now_ns () + (int64_t) ms * 1000000;
+
+  while (mexp_flush (h) > 0) {
+    now = now_ns ();
+    if (now >= end)
+      break;
+    pfd.fd = h->fd;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+    if (poll (&pfd, 1, (end - now + 999999) / 1000000) <= 0)
+      break;
+  }
+}
+
+int
+mexp_close (mexp_h *h)
+{
+  int status = 0;
+
+  if (h->priv->set_entry != NULL)
+    set_detach (h);
+  if (h->fd >= 0) {
+    if (h->priv->outq_len > 0)
+      flush_before_close (h);
+    close (h->fd);
+  }
+  if (h->pid > 0)
+    status = mexp_wait (h);
+  if (h->priv->replay != NULL)
+    replay_free (h->priv->replay);
+
+  free_handle (h);
+
+  return status;
+}
+
+mexp_h *
+mexp_spawnlf (unsigned flags, const char *file, const char *arg, ...)
+{
+  char *argv_stack[32];
+  char **argv = argv_stack;
+  size_t i, n;
+  va_list args;
+  mexp_h *h;
+
+  /* Count the arguments first, so we only allocate if there are a
+   * lot of them.
+   */
+  n = 0;
+  if (arg != NULL) {
+    va_start (args, arg);
+    for (n = 1; va_arg (args, const char *) != NULL; ++n)
+      ;
+    va_end (args);
+  }
+
+  if (n + 1 > sizeof argv_stack / sizeof argv_stack[0]) {
+    argv = malloc (sizeof (char *) * (n+1));
+    if (argv == NULL)
+      return NULL;
+  }
+
+  argv[0] = (char *) arg;
+  va_start (args, arg);
+  for (i = 1; arg != NULL; ++i) {
+    arg = va_arg (args, const char *);
+    argv[i] = (char *) arg;
+  }
+  va_end (args);
+
+  h = mexp_spawnvf (flags, file, argv);
+  if (argv != argv_stack)
+    free (argv);
+  return h;
+}
+
+/* Open a new pty master and return the name of the slave. */
+static int
+open_pty (char *slave, size_t len)
+{
+  int fd;
+
+  fd = posix_openpt (O_RDWR|O_NOCTTY);
+  if (fd == -1)
+    return -1;
+
+  if (grantpt (fd) == -1 || unlockpt (fd) == -1 ||
+      /* Get the slave pty name now, but don't open it in the parent. */
+      ptsname_r (fd, slave, len) != 0) {
+    int err = errno;
+    close (fd);
+    errno = err;
+    return -1;
+  }
+
+  return fd;
+}
+
+/* Close all file descriptors >= first. */
+static void
+close_other_fds (int first)
+{
+  int i, max_fd;
+
+#ifdef HAVE_CLOSE_RANGE
+  if (close_range (first, ~0U, 0) == 0)
+    return;
+#endif
+
+  max_fd = sysconf (_SC_OPEN_MAX);
+  if (max_fd == -1)
+    max_fd = 1024;
+  if (max_fd > 65536)
+    max_fd = 65536;      /* bound the amount of work we do here */
+  for (i = first; i < max_fd; ++i)
+    close (i);
+}
+
+#if HAVE_DECL_POSIX_SPAWN_SETSID && \
+  defined (HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP)
+#define HAVE_SPAWN_POSIX 1
+
+/* Start the subprocess using posix_spawn, which in glibc uses
+ * clone (CLONE_VM|CLONE_VFORK) so it doesn't have to copy the page
+ * tables of the parent.  This needs POSIX_SPAWN_SETSID (so the child
+ * can acquire the pty as its controlling tty) and closefrom.  Returns
+ * -1 on any failure, and the caller should fall back to spawn_fork.
+ */
+static pid_t
+spawn_posix (unsigned flags, int fd, const char *slave,
+             const char *file, char **argv)
+{
+  extern char **environ;
+  posix_spawnattr_t attr;
+  posix_spawn_file_actions_t actions;
+  short attr_flags = POSIX_SPAWN_SETSID;
+  sigset_t sigs;
+  int slave_fd;
+  pid_t pid = -1;
+  int err;
+
+  /* Open the slave in the parent only to set raw mode, since the
+   * terminal settings belong to the pty and not to the file
+   * descriptor.  The child reopens it after setsid so that it
+   * becomes the controlling tty.
+   */
+  slave_fd = open (slave, O_RDWR|O_NOCTTY|O_CLOEXEC);
+  if (slave_fd == -1)
+    return -1;
+
+  if (!(flags & MEXP_SPAWN_COOKED_MODE)) {
+    struct termios termios;
+
+    /* Set raw mode. */
+    tcgetattr (slave_fd, &termios);
+    cfmakeraw (&termios);
+    tcsetattr (slave_fd, TCSANOW, &termios);
+  }
+
+  if (posix_spawnattr_init (&attr) != 0) {
+    close (slave_fd);
+    return -1;
+  }
+  if (posix_spawn_file_actions_init (&actions) != 0) {
+    posix_spawnattr_destroy (&attr);
+    close (slave_fd);
+    return -1;
+  }
+
+  /* Remove all signal handlers, see spawn_fork. */
+  if (!(flags & MEXP_SPAWN_KEEP_SIGNALS)) {
+    sigfillset (&sigs);
+    if (posix_spawnattr_setsigdefault (&attr, &sigs) != 0)
+      goto out;
+    attr_flags |= POSIX_SPAWN_SETSIGDEF;
+  }
+  if (posix_spawnattr_setflags (&attr, attr_flags) != 0)
+    goto out;
+
+  /* File actions run after setsid. */
+  if (posix_spawn_file_actions_addopen (&actions, 0, slave, O_RDWR, 0) != 0 ||
+      posix_spawn_file_actions_adddup2 (&actions, 0, 1) != 0 ||
+      posix_spawn_file_actions_adddup2 (&actions, 0, 2) != 0 ||
+      posix_spawn_file_actions_addclose (&actions, fd) != 0)
+    goto out;
+  if (!(flags & MEXP_SPAWN_KEEP_FDS) &&
+      posix_spawn_file_actions_addclosefrom_np (&actions, 3) != 0)
+    goto out;
+
+  err = posix_spawnp (&pid, file, &actions, &attr, argv, environ);
+  if (err != 0)
+    pid = -1;
+
+ out:
+  posix_spawn_file_actions_destroy (&actions);
+  posix_spawnattr_destroy (&attr);
+  close (slave_fd);
+  return pid;
+}
+#endif /* HAVE_SPAWN_POSIX */
+
+/* Start the subprocess using fork.  This is slower than spawn_posix
+ * but works everywhere.
+ */
+static pid_t
+spawn_fork (unsigned flags, int fd, const char *slave,
+            const char *file, char **argv)
+{
+  pid_t pid;
+  int slave_fd;
+
+  pid = fork ();
+  if (pid != 0)                 /* Parent or error. */
+    return pid;
+
+  /* Child. */
+
+  if (!(flags & MEXP_SPAWN_KEEP_SIGNALS)) {
+    struct sigaction sa;
+    int i;
+
+    /* Remove all signal handlers.  See the justification here:
+     * https://www.redhat.com/archives/libvir-list/2008-August/msg00303.html
+     * We don't mask signal handlers yet, so this isn't completely
+     * race-free, but better than not doing it at all.
+     */
+    memset (&sa, 0, sizeof sa);
+    sa.sa_handler = SIG_DFL;
+    sa.sa_flags = 0;
+    sigemptyset (&sa.sa_mask);
+    for (i = 1; i < NSIG; ++i)
+      sigaction (i, &sa, NULL);
+  }
+
+  setsid ();
+
+  /* Open the slave side of the pty.  We must do this in the child
+   * after setsid so it becomes our controlling tty.
+   */
+  slave_fd = open (slave, O_RDWR);
+  if (slave_fd == -1) {
+    perror (slave);
+    _exit (EXIT_FAILURE);
+  }
+
+  if (!(flags & MEXP_SPAWN_COOKED_MODE)) {
+    struct termios termios;
+
+    /* Set raw mode. */
+    tcgetattr (slave_fd, &termios);
+    cfmakeraw (&termios);
+    tcsetattr (slave_fd, TCSANOW, &termios);
+  }
+
+  /* Set up stdin, stdout, stderr to point to the pty. */
+  dup2 (slave_fd, 0);
+  dup2 (slave_fd, 1);
+  dup2 (slave_fd, 2);
+  close (slave_fd);
+
+  /* Close the master side of the pty - do this late to avoid a
+   * kernel bug, see sshpass source code.
+   */
+  close (fd);
+
+  /* Close all other file descriptors.  This ensures that we don't
+   * hold open (eg) pipes from the parent process.
+   */
+  if (!(flags & MEXP_SPAWN_KEEP_FDS))
+    close_other_fds (3);
+
+  /* Run the subprocess. */
+  execvp (file, argv);
+  perror (file);
+  _exit (EXIT_FAILURE);
+}
+
+/* Start the subprocess on a pty.  If *fd_rtn is -1, open a new pty,
+ * else it is an unused pty (from a pool).  This is shared by
+ * mexp_spawnvf and the spawn server.  On error the pty is closed.
+ */
+static int
+spawn_pty (unsigned flags, const char *file, char **argv,
+           int *fd_rtn, pid_t *pid_rtn)
+{
+  int fd = *fd_rtn;
+  char slave[1024];
+  pid_t pid;
+
+  *fd_rtn = -1;
+  if (fd == -1)
+    fd = open_pty (slave, sizeof slave);
+  else if (ptsname_r (fd, slave, sizeof slave) != 0) {
+    close (fd);
+    return -1;
+  }
+  if (fd == -1)
+    return -1;
+
+#ifdef HAVE_SPAWN_POSIX
+  pid = spawn_posix (flags, fd, slave, file, argv);
+  if (pid == -1) {
+    /* A child which failed to exec may have taken the pty as its
+     * controlling tty and hung it up when it exited, so start again
+     * with a new pty.
+     */
+    close (fd);
+    fd = open_pty (slave, sizeof slave);
+    if (fd == -1)
+      return -1;
+    pid = spawn_fork (flags, fd, slave, file, argv);
+  }
+#else
+  pid = spawn_fork (flags, fd, slave, file, argv);
+#endif
+  if (pid == -1) {
+    int err = errno;
+    close (fd);
+    errno = err;
+    return -1;
+  }
+
+  *fd_rtn = fd;
+  *pid_rtn = pid;
+  PROBE3 (spawn, pid, fd, flags);
+  return 0;
+}
+
+mexp_h *
+mexp_spawnvf (unsigned flags, const char *file, char **argv)
+{
+  mexp_h *h;
+  int err;
+
+  /* Create the handle first so that we don't have to clean up the
+   * subprocess if it fails.
+   */
+  h = create_handle ();
+  if (h == NULL)
+    return NULL;
+
+  if (spawn_pty (flags, file, argv, &h->fd, &h->pid) == -1) {
+    err = errno;
+    mexp_close (h);
+    errno = err;
+    return NULL;
+  }
+
+  return h;
+}
+
+/* The spawn server is a small helper process, forked when the caller
+ * is still small, which spawns subprocesses on behalf of the caller.
+ * Each request carries a new socket over SCM_RIGHTS for the reply, so
+ * that several threads can use the server at the same time without
+ * any locking.
+ */
+struct mexp_server {
+  int fd;                       /* SOCK_SEQPACKET socket to server */
+  pid_t pid;                    /* server process */
+};
+
+enum { SERVER_SPAWN, SERVER_WAIT };
+
+#define SERVER_MAX_REQUEST 65536
+
+struct server_request {
+  int type;
+  unsigned flags;               /* SERVER_SPAWN: spawn flags */
+  pid_t pid;                    /* SERVER_WAIT: process to wait for */
+  int argc;                     /* SERVER_SPAWN: followed by file, argv */
+};
+
+struct server_reply {
+  int err;                      /* errno, or 0 if successful */
+  pid_t pid;                    /* SERVER_SPAWN: new process */
+  int status;                   /* SERVER_WAIT: wait status */
+};
+
+/* Send a message with an optional file descriptor attached. */
+static int
+send_with_fd (int sock, const void *buf, size_t len, int fd)
+{
+  struct msghdr msg = { 0 };
+  struct iovec iov;
+  union {
+    char buf[CMSG_SPACE (sizeof (int))];
+    struct cmsghdr align;
+  } control;
+  struct cmsghdr *cmsg;
+
+  iov.iov_base = (void *) buf;
+  iov.iov_len = len;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+
+  if (fd >= 0) {
+    memset (&control, 0, sizeof control);
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof control.buf;
+    cmsg = CMSG_FIRSTHDR (&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN (sizeof (int));
+    memcpy (CMSG_DATA (cmsg), &fd, sizeof (int));
+  }
+
+  if (sendmsg (sock, &msg, MSG_NOSIGNAL) == -1)
+    return -1;
+  return 0;
+}
+
+/* Receive a message and an optional file descriptor (else *fd is set
+ * to -1).  Returns the length of the message, 0 on EOF or -1 on error.
+ */
+static ssize_t
+recv_with_fd (int sock, void *buf, size_t len, int *fd, int flags)
+{
+  struct msghdr msg = { 0 };
+  struct iovec iov;
+  union {
+    char buf[CMSG_SPACE (sizeof (int))];
+    struct cmsghdr align;
+  } control;
+  struct cmsghdr *cmsg;
+  ssize_t r;
+
+  iov.iov_base = buf;
+  iov.iov_len = len;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof control.buf;
+
+  *fd = -1;
+  do
+    r = recvmsg (sock, &msg, flags);
+  while (r == -1 && errno == EINTR);
+  if (r <= 0)
+    return r;
+
+  for (cmsg = CMSG_FIRSTHDR (&msg); cmsg != NULL;
+       cmsg = CMSG_NXTHDR (&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+      memcpy (fd, CMSG_DATA (cmsg), sizeof (int));
+  }
+  return r;
+}
+
+static void
+server_reply (int reply_fd, int err, pid_t pid, int status, int fd)
+{
+  struct server_reply reply = { .err = err, .pid = pid, .status = status };
+
+  send_with_fd (reply_fd, &reply, sizeof reply, fd);
+  close (reply_fd);
+}
+
+/* Children of the server which have not been waited for yet. */
+struct server_child {
+  pid_t pid;
+  int exited;
+  int status;
+  int reply_fd;                 /* pending SERVER_WAIT, or -1 */
+};
+
+static void
+server_sigchld (int sig __attribute__ ((unused)))
+{
+  /* Nothing, this only interrupts ppoll. */
+}
+
+static void server_main (int sock) __attribute__ ((noreturn));
+
+static void
+server_main (int sock)
+{
+  struct sigaction sa;
+  sigset_t mask, waitmask;
+  struct server_child *children = NULL;
+  size_t nr_children = 0, i;
+  char *buf;
+  struct pollfd pfds[1];
+
+  /* Keep only stdin, stdout, stderr and the socket. */
+  if (sock != 3) {
+    if (dup3 (sock, 3, O_CLOEXEC) == -1)
+      _exit (EXIT_FAILURE);
+    sock = 3;
+  }
+  close_other_fds (4);
+
+  buf = malloc (SERVER_MAX_REQUEST);
+  if (buf == NULL)
+    _exit (EXIT_FAILURE);
+
+  /* SIGCHLD is only delivered while we are in ppoll, so that the
+   * children we spawn don't inherit it blocked.
+   */
+  sigemptyset (&mask);
+  sigaddset (&mask, SIGCHLD);
+  sigprocmask (SIG_BLOCK, &mask, &waitmask);
+  sigdelset (&waitmask, SIGCHLD);
+  memset (&sa, 0, sizeof sa);
+  sa.sa_handler = server_sigchld;
+  sigemptyset (&sa.sa_mask);
+  sigaction (SIGCHLD, &sa, NULL);
+
+  for (;;) {
+    struct server_request *req = (struct server_request *) buf;
+    ssize_t r;
+    int reply_fd, status;
+    pid_t pid;
+
+    /* Reap any children which have exited. */
+    while ((pid = waitpid (-1, &status, WNOHANG)) > 0) {
+      for (i = 0; i < nr_children; ++i) {
+        if (children[i].pid == pid) {
+          if (children[i].reply_fd >= 0) {
+            server_reply (children[i].reply_fd, 0, pid, status, -1);
+            children[i] = children[--nr_children];
+          }
+          else {
+            children[i].exited = 1;
+            children[i].status = status;
+          }
+          break;
+        }
+      }
+    }
+
+    pfds[0].fd = sock;
+    pfds[0].events = POLLIN;
+    pfds[0].revents = 0;
+    if (ppoll (pfds, 1, NULL, &waitmask) == -1)
+      continue;
+
+    r = recv_with_fd (sock, buf, SERVER_MAX_REQUEST, &reply_fd,
+                      MSG_CMSG_CLOEXEC);
+    if (r == 0)                 /* Caller closed the socket. */
+      _exit (EXIT_SUCCESS);
+    if (r == -1)
+      _exit (EXIT_FAILURE);
+    if (reply_fd == -1)
+      continue;
+    if ((size_t) r < sizeof *req) {
+      server_reply (reply_fd, EINVAL, 0, 0, -1);
+      continue;
+    }
+
+    switch (req->type) {
+    case SERVER_SPAWN: {
+      char *p = buf + sizeof *req, *end = buf + r;
+      char *file = NULL;
+      char **argv;
+      int j, fd;
+      struct server_child *new_children;
+
+      new_children = realloc (children,
+                              sizeof (struct server_child) *
+                              (nr_children + 1));
+      if (new_children == NULL) {
+        server_reply (reply_fd, errno, 0, 0, -1);
+        break;
+      }
+      children = new_children;
+
+      argv = malloc (sizeof (char *) * (req->argc + 1));
+      if (argv == NULL) {
+        server_reply (reply_fd, errno, 0, 0, -1);
+        break;
+      }
+      /* The file, then the arguments, each \0-terminated. */
+      for (j = -1; j < req->argc; ++j) {
+        char *q = memchr (p, '\0', end - p);
+        if (q == NULL)
+          break;
+        if (j == -1)
+          file = p;
+        else
+          argv[j] = p;
+        p = q + 1;
+      }
+      if (j < req->argc) {
+        free (argv);
+        server_reply (reply_fd, EINVAL, 0, 0, -1);
+        break;
+      }
+      argv[req->argc] = NULL;
+
+      sigprocmask (SIG_UNBLOCK, &mask, NULL);
+      fd = -1;
+      r = spawn_pty (req->flags, file, argv, &fd, &pid);
+      sigprocmask (SIG_BLOCK, &mask, NULL);
+      free (argv);
+      if (r == -1) {
+        server_reply (reply_fd, errno, 0, 0, -1);
+        break;
+      }
+
+      children[nr_children].pid = pid;
+      children[nr_children].exited = 0;
+      children[nr_children].reply_fd = -1;
+      nr_children++;
+      server_reply (reply_fd, 0, pid, 0, fd);
+      close (fd);
+      break;
+    }
+
+    case SERVER_WAIT:
+      for (i = 0; i < nr_children; ++i)
+        if (children[i].pid == req->pid)
+          break;
+      if (i == nr_children || children[i].reply_fd >= 0)
+        server_reply (reply_fd, ECHILD, 0, 0, -1);
+      else if (children[i].exited) {
+        server_reply (reply_fd, 0, req->pid, children[i].status, -1);
+        children[i] = children[--nr_children];
+      }
+      else
+        children[i].reply_fd = reply_fd; /* reply when it exits */
+      break;
+
+    default:
+      server_reply (reply_fd, EINVAL, 0, 0, -1);
+    }
+  }
+}
+
+mexp_server *
+mexp_server_start (void)
+{
+  mexp_server *server;
+  int sv[2];
+  pid_t pid;
+  int err;
+
+  server = malloc (sizeof *server);
+  if (server == NULL)
+    return NULL;
+
+  if (socketpair (AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0, sv) == -1) {
+    err = errno;
+    free (server);
+    errno = err;
+    return NULL;
+  }
+
+  pid = fork ();
+  if (pid == -1) {
+    err = errno;
+    close (sv[0]);
+    close (sv[1]);
+    free (server);
+    errno = err;
+    return NULL;
+  }
+
+  if (pid == 0) {               /* Child. */
+    close (sv[0]);
+    server_main (sv[1]);
+  }
+
+  /* Parent. */
+  close (sv[1]);
+  server->fd = sv[0];
+  server->pid = pid;
+  return server;
+}
+
+int
+mexp_server_stop (mexp_server *server)
+{
+  int status, ret = 0;
+
+  /* Closing the socket makes the server exit. */
+  close (server->fd);
+  if (waitpid (server->pid, &status, 0) == -1 ||
+      !WIFEXITED (status) || WEXITSTATUS (status) != 0)
+    ret = -1;
+  free (server);
+  return ret;
+}
+
+/* Send a request to the server and wait for the reply. */
+static int
+server_call (mexp_server *server, const void *req, size_t len,
+             struct server_reply *reply, int *fd)
+{
+  int sv[2];
+  ssize_t r;
+
+  if (socketpair (AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0, sv) == -1)
+    return -1;
+
+  if (send_with_fd (server->fd, req, len, sv[1]) == -1) {
+    int err = errno;
+    close (sv[0]);
+    close (sv[1]);
+    errno = err;
+    return -1;
+  }
+  close (sv[1]);
+
+  r = recv_with_fd (sv[0], reply, sizeof *reply, fd, 0);
+  close (sv[0]);
+  if (r == -1)
+    return -1;
+  if (r != sizeof *reply) {     /* The server went away. */
+    if (*fd >= 0)
+      close (*fd);
+    errno = ECONNRESET;
+    return -1;
+  }
+  if (reply->err != 0) {
+    if (*fd >= 0)
+      close (*fd);
+    errno = reply->err;
+    return -1;
+  }
+  return 0;
+}
+
+static int
+server_wait (mexp_server *server, pid_t pid)
+{
+  struct server_request req = { .type = SERVER_WAIT, .pid = pid };
+  struct server_reply reply;
+  int fd;
+
+  if (server_call (server, &req, sizeof req, &reply, &fd) == -1)
+    return -1;
+  if (fd >= 0)
+    close (fd);
+  return reply.status;
+}
+
+/* Ask the server to spawn a subprocess. */
+static int
+server_spawn (mexp_server *server, unsigned flags, const char *file,
+              char **argv, int *fd_rtn, pid_t *pid_rtn)
+{
+  struct server_request *req;
+  struct server_reply reply;
+  size_t i, len, n;
+  char *p;
+  int fd, r, err;
+
+  /* Marshal the request: the header, then file and argv as
+   * \0-terminated strings.
+   */
+  len = sizeof *req + strlen (file) + 1;
+  for (n = 0; argv[n] != NULL; ++n)
+    len += strlen (argv[n]) + 1;
+  if (len > SERVER_MAX_REQUEST) {
+    errno = E2BIG;
+    return -1;
+  }
+
+  req = malloc (len);
+  if (req == NULL)
+    return -1;
+  req->type = SERVER_SPAWN;
+  req->flags = flags;
+  req->pid = 0;
+  req->argc = n;
+  p = (char *) req + sizeof *req;
+  p = stpcpy (p, file) + 1;
+  for (i = 0; i < n; ++i)
+    p = stpcpy (p, argv[i]) + 1;
+
+  r = server_call (server, req, len, &reply, &fd);
+  err = errno;
+  free (req);
+  if (r == -1) {
+    errno = err;
+    return -1;
+  }
+  if (fd == -1) {
+    errno = EPROTO;
+    return -1;
+  }
+
+  *fd_rtn = fd;
+  *pid_rtn = reply.pid;
+  PROBE3 (spawn, reply.pid, fd, flags);
+  return 0;
+}
+
+mexp_h *
+mexp_server_spawnvf (mexp_server *server,
+                     unsigned flags, const char *file, char **argv)
+{
+  mexp_h *h;
+  int err;
+
+  h = create_handle ();
+  if (h == NULL)
+    return NULL;
+
+  if (server_spawn (server, flags, file, argv, &h->fd, &h->pid) == -1) {
+    err = errno;
+    mexp_close (h);
+    errno = err;
+    return NULL;
+  }
+
+  h->priv->server = server;
+  return h;
+}
+
+/* A pool of unused ptys, so spawning doesn't have to open one. */
+struct mexp_pty_pool {
+  size_t size;                  /* number of ptys to keep ready */
+  size_t nr;                    /* number of ptys in the pool */
+  int *fds;                     /* pty masters */
+};
+
+mexp_pty_pool *
+mexp_pty_pool_create (size_t size)
+{
+  mexp_pty_pool *pool;
+
+  pool = malloc (sizeof *pool);
+  if (pool == NULL)
+    return NULL;
+  pool->size = size;
+  pool->nr = 0;
+  pool->fds = malloc (sizeof (int) * (size > 0 ? size : 1));
+  if (pool->fds == NULL) {
+    free (pool);
+    return NULL;
+  }
+
+  if (mexp_pty_pool_fill (pool) == -1) {
+    int err = errno;
+    mexp_pty_pool_free (pool);
+    errno = err;
+    return NULL;
+  }
+
+  return pool;
+}
+
+int
+mexp_pty_pool_fill (mexp_pty_pool *pool)
+{
+  char slave[1024];
+  int fd;
+
+  while (pool->nr < pool->size) {
+    fd = open_pty (slave, sizeof slave);
+    if (fd == -1)
+      return -1;
+    /* Don't leak ptys in the pool into subprocesses. */
+    fcntl (fd, F_SETFD, FD_CLOEXEC);
+    pool->fds[pool->nr++] = fd;
+  }
+
+  return 0;
+}
+
+void
+mexp_pty_pool_free (mexp_pty_pool *pool)
+{
+  size_t i;
+
+  for (i = 0; i < pool->nr; ++i)
+    close (pool->fds[i]);
+  free (pool->fds);
+  free (pool);
+}
+
+/* Take a pty from the pool, or return -1 if it is empty. */
+static int
+pool_take (mexp_pty_pool *pool)
+{
+  if (pool == NULL || pool->nr == 0)
+    return -1;
+  return pool->fds[--pool->nr];
+}
+
+mexp_h *
+mexp_pool_spawnvf (mexp_pty_pool *pool,
+                   unsigned flags, const char *file, char **argv)
+{
+  mexp_h *h;
+  int err;
+
+  h = create_handle ();
+  if (h == NULL)
+    return NULL;
+
+  h->fd = pool_take (pool);
+  if (spawn_pty (flags, file, argv, &h->fd, &h->pid) == -1) {
+    err = errno;
+    mexp_close (h);
+    errno = err;
+    return NULL;
+  }
+
+  return h;
+}
+
+int
+mexp_respawnvf (mexp_h *h, mexp_pty_pool *pool,
+                unsigned flags, const char *file, char **argv)
+{
+  /* Finish with the previous subprocess.  The old pty can't be reused
+   * because it is hung up when its session leader exits.
+   */
+  if (h->priv->set_entry != NULL)
+    set_detach (h);
+  if (h->fd >= 0) {
+    close (h->fd);
+    h->fd = -1;
+  }
+  if (h->pid > 0)
+    mexp_wait (h);
+  if (h->priv->replay != NULL) {
+    replay_free (h->priv->replay);
+    h->priv->replay = NULL;
+  }
+  h->priv->nonblocking = 0;
+  h->priv->stepping = 0;
+  h->priv->outq_start = h->priv->outq_len = 0;
+
+  clear_buffer (h);
+  h->next_match = -1;
+
+  if (h->priv->server != NULL)
+    return server_spawn (h->priv->server, flags, file, argv, &h->fd, &h->pid);
+
+  h->fd = pool_take (pool);
+  return spawn_pty (flags, file, argv, &h->fd, &h->pid);
+}
+
+/* Drop the start of the buffer which can no longer be part of any
+ * match, to keep the buffer under max_buffer_size.  Each regexp needs
+ * the data from where it could start to match (h->priv->re_start), and
+ * also any data before that which a lookbehind assertion could look
+ * at.  In line mode the buffer only holds the current line, and
+ * h->priv->re_start is relative to it, so the same applies.
+ */
+static void
+trim_buffer (mexp_h *h, const mexp_regexp *regexps)
+{
+  const struct mexp_re_info *info = regexps_info (h);
+  size_t i, keep = h->len;
+
+  /* In DFA mode the buffer only contains data from the last read. */
+  if (active_flags (h) & MEXP_EXPECT_DFA)
+    return;
+
+  for (i = 0; regexps && regexps[i].r > 0; ++i) {
+    size_t start = h->priv->re_start[i];
+    const size_t lookbehind = info[i].lookbehind;
+
+    start = start > lookbehind ? start - lookbehind : 0;
+    if (start < keep)
+      keep = start;
+  }
+
+  if (keep == 0)
+    return;
+
+  if (h->debug_fp)
+    fprintf (h->debug_fp, "DEBUG: dropping %zu bytes from start of buffer\n",
+             keep);
+
+  memmove (&h->buffer[0], &h->buffer[keep], h->len - keep);
+  h->len -= keep;
+  h->buffer[h->len] = '\0';
+  for (i = 0; regexps && regexps[i].r > 0; ++i)
+    h->priv->re_start[i] -= keep;
+  h->priv->prefilter_pos =
+    h->priv->prefilter_pos > keep ? h->priv->prefilter_pos - keep : 0;
+  h->priv->line_scanned =
+    h->priv->line_scanned > keep ? h->priv->line_scanned - keep : 0;
+
+  /* The start of the buffer is no longer the start of the data, so
+   * don't let ^ match there.
+   */
+  h->priv->buffer_trimmed = 1;
+}
+
+/* Internal return value from the matching functions meaning that no
+ * regexp has matched yet, and we should read more data.
+ */
+#define MEXP_CONTINUE (-100)
+
+/* Search for a literal string in buffer[start..len-1].
+ *
+ * If the literal is found, returns 1 and sets *pos to the offset of
+ * the first occurrence.  Otherwise if the end of the buffer is a
+ * prefix of the literal (ie. a partial match), returns 0 and sets
+ * *pos to the offset of the longest such prefix.  Otherwise returns -1.
+ *
+ * memmem in glibc uses a vectorized search, and the partial match
+ * check only needs to look at the last literal_len-1 bytes.
+ */
+static int
+find_literal (const char *buffer, size_t len, size_t start,
+              const char *literal, size_t literal_len, size_t *pos)
+{
+  const char *p;
+  size_t i;
+
+  p = memmem (buffer + start, len - start, literal, literal_len);
+  if (p != NULL) {
+    *pos = p - buffer;
+    return 1;
+  }
+
+  i = start;
+  if (len - start >= literal_len)
+    i = len - literal_len + 1;
+  for (; i < len; ++i) {
+    if (memcmp (buffer + i, literal, len - i) == 0) {
+      *pos = i;
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+/* The prefilter (MEXP_EXPECT_PREFILTER) is an Aho-Corasick automaton
+ * built from a literal string which every match of each regexp must
+ * start with.  For a literal pattern this is the literal itself, for
+ * a regexp it is the first code unit reported by PCRE2.  Regexps
+ * where we don't know any such literal are always run.
+ *
+ * The new bytes from each read are scanned once through the
+ * automaton, and a regexp is only run when its literal has been seen
+ * (or while it has a partial match).
+ *
+ * The automaton has up to 256 ints per state, so if the literals are
+ * too long to fit in PREFILTER_MAX_STATES the prefilter is not used.
+ */
+#define PREFILTER_MAX_STATES 4096
+
+struct mexp_prefilter {
+  size_t nr_regexps;
+  char **literal;               /* per-regexp copy of the literal, or NULL */
+  int *cu;                      /* per-regexp first code unit, or -1 */
+  unsigned char *always;        /* per-regexp: no literal, always run */
+
+  size_t nr_states;
+  int *delta;                   /* [nr_states][256] transitions */
+  int *out;                     /* first regexp ending in this state, or -1 */
+  int *out_next;                /* next regexp in the same list, or -1 */
+  int *dict;                    /* next state in the fail chain with out */
+  size_t *partial_len;          /* longest proper prefix of a literal
+                                   which is a suffix of this state */
+};
+
+static void
+prefilter_free (struct mexp_prefilter *pf)
+{
+  size_t i;
+
+  if (pf == NULL)
+    return;
+  for (i = 0; pf->literal && i < pf->nr_regexps; ++i)
+    free (pf->literal[i]);
+  free (pf->literal);
+  free (pf->cu);
+  free (pf->always);
+  free (pf->delta);
+  free (pf->out);
+  free (pf->out_next);
+  free (pf->dict);
+  free (pf->partial_len);
+  free (pf);
+}
+
+/* Insert a literal into the trie, adding regexp i to the output list
+ * of the final state.
+ */
+static void
+prefilter_insert (struct mexp_prefilter *pf, size_t i,
+                  const unsigned char *literal, size_t len)
+{
+  size_t j;
+  int state = 0;
+
+  for (j = 0; j < len; ++j) {
+    int *next = &pf->delta[state * 256 + literal[j]];
+
+    if (*next == -1) {
+      *next = pf->nr_states++;
+      memset (&pf->delta[*next * 256], -1, 256 * sizeof (int));
+    }
+    state = *next;
+  }
+
+  pf->out_next[i] = pf->out[state];
+  pf->out[state] = i;
+}
+
+/* Work out the literal which every match of a regexp starts with:
+ * either its literal string, or its first code unit.  Returns false
+ * if there isn't one, and the regexp must always be run.  The
+ * prefilter depends only on these, so they are what is compared to
+ * decide if a cached prefilter can be reused.
+ */
+static int
+prefilter_literal (const struct mexp_re_info *info,
+                   const char **literal, int *cu)
+{
+  *literal = NULL;
+  *cu = -1;
+  if (info->literal) {
+    *literal = info->literal;
+    return 1;
+  }
+  if (info->first_cu >= 0 && info->first_cu < 0x80) {
+    *cu = info->first_cu;
+    return 1;
+  }
+  return 0;
+}
+
+static struct mexp_prefilter *
+prefilter_create (const mexp_regexp *regexps,
+                  const struct mexp_re_info *info)
+{
+  struct mexp_prefilter *pf;
+  size_t i, n, max_states, head, tail;
+  int *queue = NULL;
+  int *fail = NULL;
+  size_t *depth = NULL;
+  const char *literal;
+
+  for (n = 0; regexps[n].r > 0; ++n)
+    ;
+
+  pf = calloc (1, sizeof *pf);
+  if (pf == NULL)
+    return NULL;
+
+  pf->literal = calloc (n, sizeof (char *));
+  pf->cu = malloc (n * sizeof (int));
+  pf->always = malloc (n);
+  pf->out_next = malloc (n * sizeof (int));
+  if (n > 0 && (pf->literal == NULL || pf->cu == NULL ||
+                pf->always == NULL || pf->out_next == NULL))
+    goto error;
+  pf->nr_regexps = n;
+
+  /* Each regexp adds at most one state per byte of its literal, or
+   * two states for a first code unit with both cases.
+   */
+  max_states = 1;
+  for (i = 0; i < n; ++i) {
+    pf->always[i] = !prefilter_literal (&info[i], &literal, &pf->cu[i]);
+    if (literal) {
+      pf->literal[i] = strdup (literal);
+      if (pf->literal[i] == NULL)
+        goto error;
+      max_states += strlen (literal);
+    }
+    else if (pf->cu[i] >= 0)
+      max_states += 2;
+  }
+
+  /* Too big.  Keep the literals so the cache still works, but with
+   * no automaton, which means every regexp is run.
+   */
+  if (max_states > PREFILTER_MAX_STATES)
+    return pf;
+
+  pf->delta = malloc (max_states * 256 * sizeof (int));
+  pf->out = malloc (max_states * sizeof (int));
+  pf->dict = malloc (max_states * sizeof (int));
+  pf->partial_len = malloc (max_states * sizeof (size_t));
+  queue = malloc (max_states * sizeof (int));
+  fail = malloc (max_states * sizeof (int));
+  depth = malloc (max_states * sizeof (size_t));
+  if (pf->delta == NULL || pf->out == NULL || pf->dict == NULL ||
+      pf->partial_len == NULL || queue == NULL || fail == NULL ||
+      depth == NULL)
+    goto error;
+
+  memset (pf->out, -1, max_states * sizeof (int));
+  memset (pf->delta, -1, 256 * sizeof (int));
+  pf->nr_states = 1;
+
+  /* Build the trie. */
+  for (i = 0; i < n; ++i) {
+    if (pf->literal[i])
+      prefilter_insert (pf, i, (const unsigned char *) pf->literal[i],
+                        strlen (pf->literal[i]));
+    else if (pf->cu[i] >= 0) {
+      /* PCRE2 doesn't tell us if the first code unit is matched
+       * caselessly, so insert both cases.
+       */
+      unsigned char c = pf->cu[i];
+
+      prefilter_insert (pf, i, &c, 1);
+      if (isalpha (c)) {
+        c = islower (c) ? toupper (c) : tolower (c);
+        prefilter_insert (pf, i, &c, 1);
+      }
+    }
+  }
+
+  /* Breadth-first search to compute the fail links, and fill in the
+   * missing transitions so that delta is a complete DFA.
+   */
+  head = tail = 0;
+  fail[0] = 0;
+  depth[0] = 0;
+  pf->dict[0] = -1;
+  pf->partial_len[0] = 0;
+  queue[tail++] = 0;
+  while (head < tail) {
+    const int state = queue[head++];
+    int c, has_children = 0;
+
+    for (c = 0; c < 256; ++c) {
+      int *next = &pf->delta[state * 256 + c];
+
+      if (*next == -1)
+        *next = state == 0 ? 0 : pf->delta[fail[state] * 256 + c];
+      else {
+        const int child = *next;
+        const int f = state == 0 ? 0 : pf->delta[fail[state] * 256 + c];
+
+        has_children = 1;
+        fail[child] = f;
+        depth[child] = depth[state] + 1;
+        pf->dict[child] = pf->out[f] != -1 ? f : pf->dict[f];
+        queue[tail++] = child;
+      }
+    }
+
+    /* Since this state's fail link was processed earlier, its
+     * partial_len is already known.
+     */
+    if (has_children)
+      pf->partial_len[state] = depth[state];
+    else if (state != 0)
+      pf->partial_len[state] = pf->partial_len[fail[state]];
+  }
+
+  free (queue);
+  free (fail);
+  free (depth);
+  return pf;
+
+ error:
+  free (queue);
+  free (fail);
+  free (depth);
+  prefilter_free (pf);
+  return NULL;
+}
+
+/* Test if a prefilter was built from the same literals as this list
+ * of regexps.
+ */
+static int
+prefilter_is_for (const struct mexp_prefilter *pf,
+                  const mexp_regexp *regexps,
+                  const struct mexp_re_info *info)
+{
+  const char *literal;
+  size_t i;
+  int cu;
+
+  for (i = 0; i < pf->nr_regexps; ++i) {
+    if (regexps[i].r <= 0)
+      return 0;
+    prefilter_literal (&info[i], &literal, &cu);
+    if (cu != pf->cu[i] ||
+        (literal == NULL) != (pf->literal[i] == NULL) ||
+        (literal && strcmp (literal, pf->literal[i]) != 0))
+      return 0;
+  }
+  return regexps[i].r <= 0;
+}
+
+/* Choose the prefilter for the current expect call (or none), at the
+ * start of the call.  The one cached in the handle is reused if it
+ * was built from the same literals.
+ */
+static int
+select_prefilter (mexp_h *h, const mexp_regexp *regexps)
+{
+  const struct mexp_re_info *info = regexps_info (h);
+  const struct mexp_prefilter *pf = NULL;
+
+  h->priv->active_prefilter = NULL;
+  if (regexps == NULL ||
+      (active_flags (h) & (MEXP_EXPECT_DFA|MEXP_EXPECT_LINES)))
+    return 0;
+
+  if (h->priv->patterns)
+    pf = h->priv->patterns->prefilter;
+  else if (h->expect_flags & MEXP_EXPECT_PREFILTER) {
+    if (h->priv->prefilter == NULL ||
+        !prefilter_is_for (h->priv->prefilter, regexps, info)) {
+      prefilter_free (h->priv->prefilter);
+      h->priv->prefilter = prefilter_create (regexps, info);
+      if (h->priv->prefilter == NULL)
+        return -1;
+    }
+    pf = h->priv->prefilter;
+  }
+
+  /* A prefilter which was too big has no automaton. */
+  if (pf && pf->delta)
+    h->priv->active_prefilter = pf;
+  return 0;
+}
+
+mexp_patterns *
+mexp_patterns_create (void)
+{
+  mexp_patterns *p;
+
+  p = calloc (1, sizeof *p);
+  if (p == NULL)
+    return NULL;
+  p->regexps = calloc (1, sizeof *p->regexps);
+  if (p->regexps == NULL) {
+    free (p);
+    return NULL;
+  }
+  return p;
+}
+
+void
+mexp_patterns_free (mexp_patterns *p)
+{
+  size_t i;
+
+  if (p == NULL)
+    return;
+  for (i = 0; i < p->nr; ++i) {
+    pcre2_code_free ((pcre2_code *) p->regexps[i].re);
+    free (p->literals[i]);
+  }
+  free (p->regexps);
+  free (p->literals);
+  free (p->info);
+  prefilter_free (p->prefilter);
+  free (p);
+}
+
+/* Append a pattern, taking ownership of re and literal. */
+static int
+patterns_append (mexp_patterns *p, int r, pcre2_code *re, char *literal)
+{
+  if (p->compiled) {
+    errno = EBUSY;
+    return -1;
+  }
+  if (r <= 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (p->nr + 1 >= p->alloc) {
+    size_t new_alloc = p->alloc ? p->alloc * 2 : 8;
+    mexp_regexp *new_regexps;
+    char **new_literals;
+
+    new_regexps = realloc (p->regexps, new_alloc * sizeof *new_regexps);
+    if (new_regexps == NULL)
+      return -1;
+    p->regexps = new_regexps;
+    new_literals = realloc (p->literals, new_alloc * sizeof *new_literals);
+    if (new_literals == NULL)
+      return -1;
+    p->literals = new_literals;
+    p->alloc = new_alloc;
+  }
+  p->regexps[p->nr] = (mexp_regexp) { r, re, 0 };
+  p->literals[p->nr] = literal;
+  p->nr++;
+  p->regexps[p->nr] = (mexp_regexp) { 0, NULL, 0 };
+  return 0;
+}
+
+int
+mexp_patterns_add (mexp_patterns *p, int r, const char *pattern,
+                   uint32_t options,
+                   int *errorcode, PCRE2_SIZE *erroroffset)
+{
+  pcre2_code *re;
+  PCRE2_SIZE offset;
+  int code, err;
+
+  re = pcre2_compile ((PCRE2_SPTR) pattern, PCRE2_ZERO_TERMINATED, options,
+                      &code, &offset, NULL);
+  if (re == NULL) {
+    if (errorcode)
+      *errorcode = code;
+    if (erroroffset)
+      *erroroffset = offset;
+    errno = EINVAL;
+    return -1;
+  }
+  if (patterns_append (p, r, re, NULL) == -1) {
+    err = errno;
+    pcre2_code_free (re);
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
+
+/* A literal is also compiled as a PCRE2_LITERAL regexp, so that the
+ * list returned by mexp_patterns_regexps works with the ordinary
+ * functions.  mexp_expect_patterns searches for it directly.
+ */
+int
+mexp_patterns_add_literal (mexp_patterns *p, int r, const char *literal)
+{
+  pcre2_code *re;
+  char *copy;
+  PCRE2_SIZE offset;
+  int code, err;
+
+  if (literal[0] == '\0') {
+    errno = EINVAL;
+    return -1;
+  }
+  copy = strdup (literal);
+  if (copy == NULL)
+    return -1;
+  re = pcre2_compile ((PCRE2_SPTR) literal, PCRE2_ZERO_TERMINATED,
+                      PCRE2_LITERAL, &code, &offset, NULL);
+  if (re == NULL) {
+    /* The literal is too long for PCRE2, or out of memory. */
+    free (copy);
+    errno = code == PCRE2_ERROR_HEAP_FAILED ? ENOMEM : EINVAL;
+    return -1;
+  }
+  if (patterns_append (p, r, re, copy) == -1) {
+    err = errno;
+    pcre2_code_free (re);
+    free (copy);
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
+
+int
+mexp_patterns_compile (mexp_patterns *p, unsigned flags)
+{
+  const size_t n = p->nr;
+  uint32_t captures, jit = 0;
+  size_t i;
+
+  if (p->compiled) {
+    errno = EBUSY;
+    return -1;
+  }
+
+  p->info = calloc (n + 1, sizeof *p->info);
+  if (p->info == NULL)
+    return -1;
+
+  if ((flags & MEXP_EXPECT_JIT) && !(flags & MEXP_EXPECT_DFA))
+    pcre2_config (PCRE2_CONFIG_JIT, &jit);
+
+  p->ovecsize = 1;
+  for (i = 0; i < n; ++i) {
+    const pcre2_code *re = p->regexps[i].re;
+
+    /* This is the only time the regexps are modified. */
+    re_info_init (&p->info[i], &p->regexps[i], p->literals[i], jit);
+    if (pcre2_pattern_info (re, PCRE2_INFO_CAPTURECOUNT, &captures) == 0 &&
+        captures + 1 > p->ovecsize)
+      p->ovecsize = captures + 1;
+  }
+
+  if (flags & MEXP_EXPECT_PREFILTER) {
+    p->prefilter = prefilter_create (p->regexps, p->info);
+    if (p->prefilter == NULL) {
+      free (p->info);
+      p->info = NULL;
+      return -1;
+    }
+  }
+
+  p->id = __atomic_add_fetch (&patterns_id, 1, __ATOMIC_RELAXED);
+  p->flags = flags;
+  p->compiled = 1;
+  return 0;
+}
+
+const mexp_regexp *
+mexp_patterns_regexps (const mexp_patterns *p)
+{
+  return p->regexps;
+}
+
+pcre2_match_data *
+mexp_patterns_match_data_create (const mexp_patterns *p)
+{
+  return pcre2_match_data_create (p->ovecsize ? p->ovecsize : 1, NULL);
+}
+
+/* Run the bytes in the buffer which have not been scanned yet through
+ * the automaton, and flag the regexps whose literal appears.
+ */
+static void
+prefilter_scan (mexp_h *h, const struct mexp_prefilter *pf)
+{
+  const unsigned char *p = (const unsigned char *) h->buffer;
+  int state = h->priv->prefilter_state;
+  size_t i;
+
+  for (i = h->priv->prefilter_pos; i < h->len; ++i) {
+    int s;
+
+    state = pf->delta[state * 256 + p[i]];
+    s = pf->out[state] != -1 ? state : pf->dict[state];
+    for (; s != -1; s = pf->dict[s]) {
+      int j;
+
+      for (j = pf->out[s]; j != -1; j = pf->out_next[j])
+        h->priv->re_run[j] = 1;
+    }
+  }
+
+  h->priv->prefilter_state = state;
+  h->priv->prefilter_pos = h->len;
+}
+
+/* Match the list of regexps against the buffer using pcre2_match. */
+static int
+match_regexps (mexp_h *h, const mexp_regexp *regexps,
+               pcre2_match_data *match_data)
+{
+  size_t i;
+  int r;
+  int can_clear_buffer = 1;
+  pcre2_match_context *match_context = get_jit_match_context (h);
+  const struct mexp_re_info *info = regexps_info (h);
+  const struct mexp_prefilter *pf = h->priv->active_prefilter;
+
+  if (pf)
+    prefilter_scan (h, pf);
+
+  for (i = 0; regexps[i].r > 0; ++i) {
+    int options = regexps[i].options | PCRE2_PARTIAL_SOFT;
+    size_t start;
+
+    if (h->priv->buffer_trimmed)
+      options |= PCRE2_NOTBOL;
+
+    if (pf && !pf->always[i] && !h->priv->re_run[i]) {
+      /* The literal hasn't been seen, so this can't match yet.  But
+       * the end of the buffer might be the start of the literal.
+       */
+      const size_t partial_len = pf->partial_len[h->priv->prefilter_state];
+
+      if (partial_len > 0) {
+        can_clear_buffer = 0;
+        if (h->priv->re_start[i] < h->len - partial_len)
+          h->priv->re_start[i] = h->len - partial_len;
+      }
+      else
+        h->priv->re_start[i] = h->len;
+      continue;
+    }
+
+    if (info[i].literal) {
+      /* A literal string. */
+      const size_t literal_len = info[i].literal_len;
+      size_t pos;
+
+      switch (find_literal (h->buffer, h->len, h->priv->re_start[i],
+                            info[i].literal, literal_len, &pos)) {
+      case 1:
+        h->next_match = pos + literal_len;
+        if (h->debug_fp)
+          fprintf (h->debug_fp, "DEBUG: next_match at buffer offset %zu\n",
+                   h->next_match);
+        return regexps[i].r;
+      case 0:
+        can_clear_buffer = 0;
+        h->priv->re_start[i] = pos;
+        h->priv->re_run[i] = 1;
+        break;
+      default:
+        h->priv->re_start[i] = h->len;
+        h->priv->re_run[i] = 0;
+      }
+      continue;
+    }
+
+    /* Resume from where this regexp could last have started to
+     * match.  An anchored regexp is anchored at the start offset,
+     * so for those we must always start from the beginning.
+     */
+    start = info[i].anchored ? 0 : h->priv->re_start[i];
+
+    h->priv->stats.matches++;
+    r = pcre2_match (regexps[i].re,
+                     (PCRE2_SPTR) h->buffer, (int)h->len, start,
+                     options, match_data, match_context);
+    h->pcre_error = r;
+    PROBE4 (match, h->pid, regexps[i].r, start, r);
+
+    if (r >= 0) {
+      /* A full match. */
+      const PCRE2_SIZE *ovector = NULL;
+
+      if (match_data)
+        ovector = pcre2_get_ovector_pointer (match_data);
+
+      if (ovector != NULL && ovector[1] != ~(PCRE2_SIZE)0)
+        h->next_match = ovector[1];
+      else
+        h->next_match = -1;
+      if (h->debug_fp)
+        fprintf (h->debug_fp, "DEBUG: next_match at buffer offset %zu\n",
+                 h->next_match);
+      h->jit_used = jit_matched (h, &info[i], options);
+      return regexps[i].r;
+    }
+
+    else if (r == PCRE2_ERROR_NOMATCH) {
+      /* No match at all.  No match can start before the end of
+       * the current buffer, so next time only look at new data.
+       */
+      h->priv->re_start[i] = h->len;
+      h->priv->re_run[i] = 0;
+    }
+
+    else if (r == PCRE2_ERROR_PARTIAL) {
+      /* Partial match.  Keep the buffer and keep reading.  The
+       * partial match is the earliest place that a full match
+       * could start, so next time resume from there.
+       */
+      can_clear_buffer = 0;
+      h->priv->re_run[i] = 1;
+      if (match_data) {
+        const PCRE2_SIZE *ovector;
+
+        ovector = pcre2_get_ovector_pointer (match_data);
+        h->priv->re_start[i] = ovector[0];
+      }
+    }
+
+    else {
+      /* An actual PCRE error. */
+      return MEXP_PCRE_ERROR;
+    }
+  }
+
+  /* If none of the regular expressions matched (not partially)
+   * then we can clear the buffer.  This is an optimization.
+   */
+  if (can_clear_buffer)
+    clear_buffer (h);
+
+  return MEXP_CONTINUE;
+}
+
+/* Size of the pcre2_dfa_match workspace for each regexp, in ints. */
+#define DFA_WORKSPACE_SIZE 1000
+
+/* Match a literal string in MEXP_EXPECT_DFA mode.  Since the data
+ * from earlier reads has been thrown away, *state is the length of
+ * the prefix of the literal which was at the end of the data, and we
+ * try to continue it (or any shorter prefix which is also a suffix of
+ * it) into the new data first.
+ */
+static int
+match_literal_dfa (mexp_h *h, const mexp_regexp *regexp,
+                   const struct mexp_re_info *info, size_t *state)
+{
+  const char *literal = info->literal;
+  const size_t literal_len = info->literal_len;
+  size_t k = *state, j, pos;
+  int r;
+
+  *state = 0;
+
+  for (j = k; j > 0; --j) {
+    const size_t rest = literal_len - j;
+
+    if (memcmp (literal + k - j, literal, j) != 0)
+      continue;
+
+    if (h->len >= rest && memcmp (h->buffer, literal + j, rest) == 0) {
+      h->next_match = rest;
+      return regexp->r;
+    }
+    if (h->len < rest && memcmp (h->buffer, literal + j, h->len) == 0) {
+      *state = j + h->len;
+      return MEXP_CONTINUE;
+    }
+  }
+
+  r = find_literal (h->buffer, h->len, 0, literal, literal_len, &pos);
+  if (r == 1) {
+    h->next_match = pos + literal_len;
+    return regexp->r;
+  }
+  if (r == 0)
+    *state = h->len - pos;
+  return MEXP_CONTINUE;
+}
+
+/* Match the list of regexps against the buffer using pcre2_dfa_match
+ * (MEXP_EXPECT_DFA).  The state of partial matches is kept in the
+ * per-regexp DFA workspace, so the buffer can be discarded after
+ * each read.  In this mode h->priv->re_start[i] is non-zero if regexp i
+ * has a partial match in progress which should be continued using
+ * PCRE2_DFA_RESTART (or for a literal string, the length of the
+ * partial match).
+ */
+static int
+match_regexps_dfa (mexp_h *h, const mexp_regexp *regexps,
+                   pcre2_match_data *match_data)
+{
+  const struct mexp_re_info *info = regexps_info (h);
+  size_t i, n;
+  int r;
+
+  for (n = 0; regexps[n].r > 0; ++n)
+    ;
+  if (n * DFA_WORKSPACE_SIZE > h->priv->nr_dfa_workspace) {
+    int *new_workspace;
+
+    new_workspace = realloc (h->priv->dfa_workspace,
+                             n * DFA_WORKSPACE_SIZE * sizeof (int));
+    if (new_workspace == NULL)
+      return MEXP_ERROR;
+    h->priv->dfa_workspace = new_workspace;
+    h->priv->nr_dfa_workspace = n * DFA_WORKSPACE_SIZE;
+  }
+
+  for (i = 0; i < n; ++i) {
+    const int options = regexps[i].options | PCRE2_PARTIAL_SOFT;
+    int *workspace = &h->priv->dfa_workspace[i * DFA_WORKSPACE_SIZE];
+
+    if (info[i].literal) {
+      r = match_literal_dfa (h, &regexps[i], &info[i],
+                             &h->priv->re_start[i]);
+      if (r != MEXP_CONTINUE)
+        return r;
+      continue;
+    }
+
+    r = PCRE2_ERROR_NOMATCH;
+    if (h->priv->re_start[i]) {
+      /* Continue the partial match into the new data. */
+      h->priv->stats.matches++;
+      r = pcre2_dfa_match (regexps[i].re,
+                           (PCRE2_SPTR) h->buffer, h->len, 0,
+                           options | PCRE2_DFA_RESTART, match_data, NULL,
+                           workspace, DFA_WORKSPACE_SIZE);
+      PROBE4 (match, h->pid, regexps[i].r, 0, r);
+      h->priv->re_start[i] = 0;
+    }
+    if (r == PCRE2_ERROR_NOMATCH) {
+      /* Look for a new match starting in the new data. */
+      h->priv->stats.matches++;
+      r = pcre2_dfa_match (regexps[i].re,
+                           (PCRE2_SPTR) h->buffer, h->len, 0,
+                           options, match_data, NULL,
+                           workspace, DFA_WORKSPACE_SIZE);
+      PROBE4 (match, h->pid, regexps[i].r, 0, r);
+    }
+    h->pcre_error = r;
+
+    if (r >= 0) {
+      /* A full match.  pcre2_dfa_match returns 0 if there were more
+       * matches than fit in the ovector, but the longest match is
+       * always in the first pair.
+       */
+      const PCRE2_SIZE *ovector = NULL;
+
+      if (match_data)
+        ovector = pcre2_get_ovector_pointer (match_data);
+
+      if (ovector != NULL && ovector[1] != ~(PCRE2_SIZE)0)
+        h->next_match = ovector[1];
+      else
+        h->next_match = -1;
+      if (h->debug_fp)
+        fprintf (h->debug_fp, "DEBUG: next_match at buffer offset %zu\n",
+                 h->next_match);
+      return regexps[i].r;
+    }
+
+    else if (r == PCRE2_ERROR_NOMATCH)
+      /* (nothing here) */;
+
+    else if (r == PCRE2_ERROR_PARTIAL)
+      /* The state of the partial match is saved in the workspace. */
+      h->priv->re_start[i] = 1;
+
+    else {
+      /* An actual PCRE error. */
+      return MEXP_PCRE_ERROR;
+    }
+  }
+
+  /* Nothing matched, so throw away the data we have just read.  The
+   * memory is kept so that the next read can reuse it.
+   */
+  h->len = 0;
+  h->buffer[0] = '\0';
+
+  return MEXP_CONTINUE;
+}
+
+/* Match the regexps against one line in MEXP_EXPECT_LINES mode.  len
+ * does not include the line ending.  If partial is true, this is the
+ * line still being read, which is matched like the end of the buffer
+ * in the normal mode (PCRE2_PARTIAL_SOFT).  If notbol is true, the
+ * start of the line has been dropped.  h->priv->re_start[i] is where
+ * regexp i could first start to match in this line.
+ *
+ * On a match, *end is set to the end of the match in the line, or -1
+ * if it is not known.
+ */
+static int
+match_line (mexp_h *h, const mexp_regexp *regexps,
+            pcre2_match_data *match_data, const char *line, size_t len,
+            int partial, int notbol, ssize_t *end)
+{
+  pcre2_match_context *match_context = get_jit_match_context (h);
+  const struct mexp_re_info *info = regexps_info (h);
+  size_t i;
+  int r;
+
+  for (i = 0; regexps[i].r > 0; ++i) {
+    const int options =
+      regexps[i].options | (partial ? PCRE2_PARTIAL_SOFT : 0) |
+      (notbol ? PCRE2_NOTBOL : 0);
+    size_t start = h->priv->re_start[i] < len ? h->priv->re_start[i] : len;
+
+    if (info[i].literal) {
+      /* A literal string. */
+      const size_t literal_len = info[i].literal_len;
+      size_t pos;
+
+      r = find_literal (line, len, start,
+                        info[i].literal, literal_len, &pos);
+      if (r == 1) {
+        *end = pos + literal_len;
+        return regexps[i].r;
+      }
+      h->priv->re_start[i] = r == 0 ? pos : len;
+      continue;
+    }
+
+    if (info[i].anchored)
+      start = 0;
+
+    h->priv->stats.matches++;
+    r = pcre2_match (regexps[i].re, (PCRE2_SPTR) line, len, start,
+                     options, match_data, match_context);
+    h->pcre_error = r;
+    PROBE4 (match, h->pid, regexps[i].r, start, r);
+
+    if (r >= 0) {
+      const PCRE2_SIZE *ovector = NULL;
+
+      if (match_data)
+        ovector = pcre2_get_ovector_pointer (match_data);
+      if (ovector != NULL && ovector[1] != ~(PCRE2_SIZE)0)
+        *end = ovector[1];
+      else
+        *end = -1;
+      h->jit_used = jit_matched (h, &info[i], options);
+      return regexps[i].r;
+    }
+    else if (r == PCRE2_ERROR_NOMATCH)
+      h->priv->re_start[i] = len;
+    else if (r == PCRE2_ERROR_PARTIAL) {
+      if (match_data)
+        h->priv->re_start[i] = pcre2_get_ovector_pointer (match_data)[0];
+    }
+    else
+      return MEXP_PCRE_ERROR;
+  }
+
+  return MEXP_CONTINUE;
+}
+
+/* Drop the first n bytes of the buffer, which in line mode are lines
+ * that have already been matched.
+ */
+static void
+drop_lines (mexp_h *h, size_t n)
+{
+  if (n == 0)
+    return;
+  memmove (&h->buffer[0], &h->buffer[n], h->len - n);
+  h->len -= n;
+  h->buffer[h->len] = '\0';
+  h->priv->line_scanned -= n;
+}
+
+/* Strip \r from the end of a line (ptys turn \n into \r\n). */
+static size_t
+line_length (const char *line, size_t len)
+{
+  if (len > 0 && line[len-1] == '\r')
+    len--;
+  return len;
+}
+
+/* Match in MEXP_EXPECT_LINES mode.  Each line completed by the new
+ * data is matched on its own, and dropped from the buffer if nothing
+ * matched.  Then the partial line at the end is tried, for prompts.
+ * So the buffer only ever holds the current line.  While a line is
+ * partial each regexp resumes from where a match could still start,
+ * so a long line isn't scanned from the beginning after every read.
+ *
+ * If the buffer starts part way through a line (after an earlier
+ * match, or because trim_buffer dropped the start of a long line),
+ * h->priv->buffer_trimmed is set and ^ doesn't match at the start of the
+ * first line.
+ */
+static int
+match_regexps_lines (mexp_h *h, const mexp_regexp *regexps,
+                     pcre2_match_data *match_data)
+{
+  size_t n, pos = 0, len;
+  const char *nl;
+  ssize_t end;
+  int r;
+
+  for (n = 0; regexps[n].r > 0; ++n)
+    ;
+
+  while ((nl = memchr (&h->buffer[h->priv->line_scanned], '\n',
+                       h->len - h->priv->line_scanned)) != NULL) {
+    const size_t next = nl - h->buffer + 1;
+
+    len = line_length (&h->buffer[pos], next - 1 - pos);
+    r = match_line (h, regexps, match_data, &h->buffer[pos], len, 0,
+                    pos == 0 && h->priv->buffer_trimmed, &end);
+    if (r != MEXP_CONTINUE) {
+      if (r > 0) {
+        /* The ovector is relative to the line, so move the line to
+         * the start of the buffer.  The next expect continues after
+         * the match, or with the following line if the end of the
+         * match isn't known.
+         */
+        drop_lines (h, pos);
+        h->next_match = end >= 0 ? (size_t) end : next - pos;
+        if (h->debug_fp)
+          fprintf (h->debug_fp, "DEBUG: next_match at buffer offset %zu\n",
+                   h->next_match);
+      }
+      return r;
+    }
+
+    pos = h->priv->line_scanned = next;
+    h->priv->buffer_trimmed = 0;
+    if (n > 0)
+      memset (h->priv->re_start, 0, n * sizeof (size_t));
+  }
+  h->priv->line_scanned = h->len;
+  drop_lines (h, pos);
+
+  len = line_length (h->buffer, h->len);
+  if (len == 0)
+    return MEXP_CONTINUE;
+  r = match_line (h, regexps, match_data, h->buffer, len, 1,
+                  h->priv->buffer_trimmed, &end);
+  if (r > 0) {
+    h->next_match = end;
+    if (h->debug_fp)
+      fprintf (h->debug_fp, "DEBUG: next_match at buffer offset %zu\n",
+               h->next_match);
+  }
+  return r;
+}
+
+/* Work out when the current call to mexp_expect has to give up:
+ * either after h->timeout, or at the deadline, whichever comes first.
+ * Returns -1 if there is no limit.
+ */
+static int64_t
+expect_end (mexp_h *h)
+{
+  int64_t end = -1;
+
+  if (h->timeout >= 0)
+    end = now_ns () + (int64_t) h->timeout * 1000000;
+  if (h->priv->deadline >= 0 && (end == -1 || h->priv->deadline < end))
+    end = h->priv->deadline;
+  return end;
+}
+
+void
+mexp_set_log_callback (mexp_h *h, mexp_log_callback cb, void *opaque)
+{
+  h->priv->log_cb = cb;
+  h->priv->log_opaque = opaque;
+}
+
+void
+mexp_set_log_rate_limit (mexp_h *h, unsigned per_second, unsigned burst)
+{
+  h->priv->log_rate = per_second;
+  h->priv->log_burst = burst > 0 ? burst : 1;
+  h->priv->log_tokens = h->priv->log_burst;
+  h->priv->log_refilled = now_ns ();
+}
+
+/* Pass an event to the log callback, if there is one.  With a rate
+ * limit, this is a token bucket holding up to log_burst events and
+ * refilled at log_rate events per second.  Events are dropped while
+ * it is empty, and the number dropped is passed with the next event.
+ */
+static void
+log_event (mexp_h *h, int type, int r, const char *data, size_t len)
+{
+  struct mexp_log_event event;
+
+  if (h->priv->log_cb == NULL)
+    return;
+
+  if (h->priv->log_rate > 0) {
+    const int64_t now = now_ns ();
+
+    h->priv->log_tokens +=
+      (now - h->priv->log_refilled) * 1e-9 * h->priv->log_rate;
+    if (h->priv->log_tokens > h->priv->log_burst)
+      h->priv->log_tokens = h->priv->log_burst;
+    h->priv->log_refilled = now;
+    if (h->priv->log_tokens < 1) {
+      h->priv->log_dropped++;
+      return;
+    }
+    h->priv->log_tokens -= 1;
+  }
+
+  event.type = type;
+  event.pid = h->pid;
+  event.r = r;
+  event.data = data;
+  event.len = len;
+  event.dropped = h->priv->log_dropped;
+  h->priv->log_dropped = 0;
+  h->priv->log_cb (h, &event, h->priv->log_opaque);
+}
+
+void
+mexp_get_stats (mexp_h *h, struct mexp_stats *stats)
+{
+  *stats = h->priv->stats;
+}
+
+const struct mexp_histogram *
+mexp_get_histograms (mexp_h *h, size_t *nr)
+{
+  *nr = h->priv->nr_histograms;
+  return h->priv->histograms;
+}
+
+void
+mexp_reset_stats (mexp_h *h)
+{
+  memset (&h->priv->stats, 0, sizeof h->priv->stats);
+  h->priv->nr_histograms = 0;
+}
+
+/* Add the time taken by the expect call which just returned r to
+ * the histogram for r.  Bucket 0 counts times under 1us, and bucket
+ * i times from 2^(i-1) to 2^i us.  If we can't allocate a new
+ * histogram, the time is silently not recorded.
+ */
+static int
+expect_done (mexp_h *h, int r)
+{
+  struct mexp_histogram *hist = NULL;
+  uint64_t ns, us;
+  size_t i;
+  int bucket;
+
+  h->priv->stats.expects++;
+  ns = now_ns () - h->priv->expect_started;
+  PROBE3 (expect, h->pid, r, ns);
+  log_event (h, MEXP_LOG_RESULT, r, NULL, 0);
+
+  for (i = 0; i < h->priv->nr_histograms; ++i) {
+    if (h->priv->histograms[i].r == r) {
+      hist = &h->priv->histograms[i];
+      break;
+    }
+  }
+  if (hist == NULL) {
+    if (h->priv->nr_histograms == h->priv->alloc_histograms) {
+      size_t new_alloc =
+        h->priv->alloc_histograms ? h->priv->alloc_histograms * 2 : 4;
+      struct mexp_histogram *new_histograms;
+      int err = errno;
+
+      /* Callers look at errno after some results, so preserve it. */
+      new_histograms = realloc (h->priv->histograms,
+                                new_alloc * sizeof *new_histograms);
+      errno = err;
+      if (new_histograms == NULL)
+        return r;
+      h->priv->histograms = new_histograms;
+      h->priv->alloc_histograms = new_alloc;
+    }
+    hist = &h->priv->histograms[h->priv->nr_histograms++];
+    memset (hist, 0, sizeof *hist);
+    hist->r = r;
+  }
+
+  us = ns / 1000;
+  bucket = us == 0 ? 0 : 64 - __builtin_clzll (us);
+  if (bucket >= MEXP_HISTOGRAM_BUCKETS)
+    bucket = MEXP_HISTOGRAM_BUCKETS - 1;
+  hist->buckets[bucket]++;
+  hist->count++;
+  hist->total_ns += ns;
+  if (ns > hist->max_ns)
+    hist->max_ns = ns;
+  return r;
+}
+
+/* See if there is a full or partial match against any regexp. */
+static int
+expect_match (mexp_h *h, const mexp_regexp *regexps,
+              pcre2_match_data *match_data)
+{
+  int64_t start;
+  int r;
+
+  if (regexps == NULL)
+    return MEXP_CONTINUE;
+
+  assert (h->buffer != NULL);
+
+  start = now_ns ();
+  if (active_flags (h) & MEXP_EXPECT_LINES)
+    r = match_regexps_lines (h, regexps, match_data);
+  else if (active_flags (h) & MEXP_EXPECT_DFA)
+    r = match_regexps_dfa (h, regexps, match_data);
+  else
+    r = match_regexps (h, regexps, match_data);
+  h->priv->stats.match_ns += now_ns () - start;
+  return r;
+}
+
+/* Start a new expect call.  Returns MEXP_CONTINUE if we have to read
+ * more data, else the result.
+ */
+static int
+expect_begin (mexp_h *h, const mexp_regexp *regexps,
+              pcre2_match_data *match_data)
+{
+  const uint64_t id = h->priv->patterns ? h->priv->patterns->id : 0;
+  const struct mexp_re_info *info;
+  int resume;
+  size_t i;
+
+  h->priv->expect_started = now_ns ();
+  h->jit_used = 0;
+  if (prepare_regexps (h, regexps) == -1)
+    return MEXP_ERROR;
+
+  if (h->next_match == -1) {
+    /* Fully clear the buffer, then read. */
+    clear_buffer (h);
+    h->priv->re_start_id = id;
+    return MEXP_CONTINUE;
+  }
+
+  /* See the comment in the manual about h->next_match.  We have
+   * some data remaining in the buffer, so begin by matching that.
+   *
+   * If the last expect was for the same mexp_patterns, the offsets
+   * where each regexp could next start to match are still good for
+   * the remaining data, so we needn't scan it again.  Only regexps
+   * which can't look at data before the start of the match can do
+   * this, since the remaining data now starts the buffer.  A list
+   * passed to mexp_expect may have changed even if it is at the same
+   * address, so in that case (and in DFA and line mode, which keep
+   * offsets differently) the remaining data is scanned again.
+   */
+  info = regexps_info (h);
+  resume = id != 0 && id == h->priv->re_start_id &&
+    !(active_flags (h) & (MEXP_EXPECT_DFA|MEXP_EXPECT_LINES));
+  for (i = 0; regexps && regexps[i].r > 0; ++i) {
+    if (resume && info[i].resumable &&
+        h->priv->re_start[i] > (size_t) h->next_match)
+      h->priv->re_start[i] -= h->next_match;
+    else
+      h->priv->re_start[i] = 0;
+    h->priv->re_run[i] = 0;
+  }
+  h->priv->re_start_id = id;
+
+  /* In line mode the remaining data may start part way through a
+   * line, where ^ must not match.
+   */
+  h->priv->buffer_trimmed =
+    (active_flags (h) & MEXP_EXPECT_LINES) &&
+    h->next_match > 0 && h->buffer[h->next_match-1] != '\n';
+  memmove (&h->buffer[0], &h->buffer[h->next_match], h->len - h->next_match);
+  h->len -= h->next_match;
+  h->buffer[h->len] = '\0';
+  h->next_match = -1;
+  h->priv->line_scanned = 0;
+  return expect_match (h, regexps, match_data);
+}
+
+/* Write a chunk of output to the sink fd. */
+static int
+write_sink (int fd, const char *buf, size_t len)
+{
+  ssize_t r;
+
+  while (len > 0) {
+    r = write (fd, buf, len);
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    buf += r;
+    len -= r;
+  }
+  return 0;
+}
+
+/* Recordings start with this magic string, followed by one frame for
+ * each chunk read from the subprocess.  A frame is an 8 byte header
+ * holding the time since the previous frame (or since recording
+ * started) in microseconds and the length of the chunk, both as
+ * little-endian 32 bit integers, followed by the chunk itself.
+ */
+#define RECORD_MAGIC "MEXPREC1"
+#define RECORD_MAGIC_LEN 8
+#define FRAME_HEADER_LEN 8
+
+static void
+put_le32 (unsigned char *p, uint32_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static uint32_t
+get_le32 (const unsigned char *p)
+{
+  return p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 |
+    (uint32_t) p[3] << 24;
+}
+
+/* Block SIGPIPE while writing to the sink or the recording, so that
+ * writing to a closed pipe fails with EPIPE instead of killing the
+ * caller.
+ */
+static void
+block_sigpipe (sigset_t *old_set)
+{
+  sigset_t pipe_set;
+
+  sigemptyset (&pipe_set);
+  sigaddset (&pipe_set, SIGPIPE);
+  pthread_sigmask (SIG_BLOCK, &pipe_set, old_set);
+}
+
+/* Restore the signal mask.  If a write failed with EPIPE, first
+ * discard the SIGPIPE it raised, unless the caller was blocking
+ * SIGPIPE already (in which case it is theirs to deal with).
+ */
+static void
+unblock_sigpipe (const sigset_t *old_set, int epipe)
+{
+  sigset_t pipe_set;
+  const struct timespec zero = { 0, 0 };
+  int err = errno;
+
+  if (epipe && !sigismember (old_set, SIGPIPE)) {
+    sigemptyset (&pipe_set);
+    sigaddset (&pipe_set, SIGPIPE);
+    while (sigtimedwait (&pipe_set, NULL, &zero) == -1 && errno == EINTR)
+      ;
+  }
+  pthread_sigmask (SIG_SETMASK, old_set, NULL);
+  errno = err;
+}
+
+int
+mexp_start_recording (mexp_h *h, int fd)
+{
+  sigset_t old_set;
+  int r;
+
+  block_sigpipe (&old_set);
+  r = write_sink (fd, RECORD_MAGIC, RECORD_MAGIC_LEN);
+  unblock_sigpipe (&old_set, r == -1 && errno == EPIPE);
+  if (r == -1)
+    return -1;
+  h->priv->record_fd = fd;
+  h->record_error = 0;
+  h->priv->record_last = now_ns ();
+  return 0;
+}
+
+void
+mexp_stop_recording (mexp_h *h)
+{
+  h->priv->record_fd = -1;
+}
+
+/* Append one frame to the recording, normally with a single syscall. */
+static int
+record_frame (mexp_h *h, const char *buf, size_t len)
+{
+  unsigned char hdr[FRAME_HEADER_LEN];
+  struct iovec iov[2];
+  int64_t now, delta;
+  ssize_t r;
+
+  now = now_ns ();
+  delta = (now - h->priv->record_last) / 1000;
+  if (delta > UINT32_MAX)
+    delta = UINT32_MAX;
+  h->priv->record_last = now;
+  put_le32 (hdr, delta);
+  put_le32 (hdr + 4, len);
+
+  iov[0].iov_base = hdr;
+  iov[0].iov_len = sizeof hdr;
+  iov[1].iov_base = (void *) buf;
+  iov[1].iov_len = len;
+  do
+    r = writev (h->priv->record_fd, iov, 2);
+  while (r == -1 && errno == EINTR);
+  if (r == -1)
+    return -1;
+
+  /* Complete a short write. */
+  if ((size_t) r < sizeof hdr)
+    return write_sink (h->priv->record_fd,
+                       (char *) hdr + r, sizeof hdr - r) == -1 ?
+      -1 : write_sink (h->priv->record_fd, buf, len);
+  r -= sizeof hdr;
+  return write_sink (h->priv->record_fd, buf + r, len - r);
+}
+
+/* Copy a chunk read from the subprocess to the sink and the
+ * recording.  If either fails it is turned off and the error is saved
+ * for mexp_get_sink_error or mexp_get_record_error, but the data is
+ * still matched as usual.  The writes are synchronous, and the
+ * callers check the time after each read, so a slow sink uses up the
+ * timeout rather than extending it.  A non-blocking sink which is
+ * full fails with EAGAIN like any other error.
+ */
+static void
+write_outputs (mexp_h *h, const char *buf, size_t len)
+{
+  sigset_t old_set;
+  int epipe = 0;
+
+  block_sigpipe (&old_set);
+  if (h->sink_fd >= 0 && write_sink (h->sink_fd, buf, len) == -1) {
+    h->sink_error = errno;
+    h->sink_fd = -1;
+    epipe |= h->sink_error == EPIPE;
+    if (h->debug_fp)
+      fprintf (h->debug_fp, "DEBUG: writing to sink: %s\n",
+               strerror (h->sink_error));
+  }
+  if (h->priv->record_fd >= 0 && record_frame (h, buf, len) == -1) {
+    h->record_error = errno;
+    h->priv->record_fd = -1;
+    epipe |= h->record_error == EPIPE;
+    if (h->debug_fp)
+      fprintf (h->debug_fp, "DEBUG: writing to recording: %s\n",
+               strerror (h->record_error));
+  }
+  unblock_sigpipe (&old_set, epipe);
+}
+
+/* A recording being replayed.  Each frame becomes due at the time
+ * the replay was opened plus the sum of the deltas so far.
+ */
+struct mexp_replay {
+  const unsigned char *data;
+  size_t size;
+  size_t pos;                   /* offset of next unread data */
+  size_t frame_end;             /* end of current frame, if in_frame */
+  int in_frame;
+  int mapped;                   /* data is mmapped, else malloced */
+  int realtime;                 /* MEXP_REPLAY_REALTIME */
+  int64_t due;                  /* when current frame is due */
+};
+
+static void
+replay_free (struct mexp_replay *rp)
+{
+  if (rp->mapped)
+    munmap ((void *) rp->data, rp->size);
+  else
+    free ((void *) rp->data);
+  free (rp);
+}
+
+/* Read the whole of a file which can't be mapped into memory. */
+static unsigned char *
+read_file (int fd, size_t *size_rtn)
+{
+  unsigned char *data = NULL, *new_data;
+  size_t size = 0, alloc = 0;
+  ssize_t r;
+
+  for (;;) {
+    if (size == alloc) {
+      alloc = alloc ? alloc * 2 : 64 * 1024;
+      new_data = realloc (data, alloc);
+      if (new_data == NULL) {
+        free (data);
+        return NULL;
+      }
+      data = new_data;
+    }
+    r = read (fd, data + size, alloc - size);
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      free (data);
+      return NULL;
+    }
+    if (r == 0)
+      break;
+    size += r;
+  }
+
+  *size_rtn = size;
+  return data;
+}
+
+mexp_h *
+mexp_replay_open (const char *filename, unsigned flags)
+{
+  struct mexp_replay *rp;
+  struct stat statbuf;
+  void *data;
+  mexp_h *h;
+  int fd, err;
+
+  rp = calloc (1, sizeof *rp);
+  if (rp == NULL)
+    return NULL;
+  rp->realtime = (flags & MEXP_REPLAY_REALTIME) != 0;
+
+  fd = open (filename, O_RDONLY|O_CLOEXEC);
+  if (fd == -1) {
+    free (rp);
+    return NULL;
+  }
+  if (!(flags & MEXP_REPLAY_NO_MMAP) &&
+      fstat (fd, &statbuf) == 0 && S_ISREG (statbuf.st_mode) &&
+      statbuf.st_size > 0) {
+    data = mmap (NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+      madvise (data, statbuf.st_size, MADV_SEQUENTIAL);
+      rp->data = data;
+      rp->size = statbuf.st_size;
+      rp->mapped = 1;
+    }
+  }
+  /* Fall back to reading it, eg. if it's a pipe. */
+  if (!rp->mapped)
+    rp->data = read_file (fd, &rp->size);
+  err = errno;
+  close (fd);
+  if (rp->data == NULL) {
+    free (rp);
+    errno = err;
+    return NULL;
+  }
+
+  if (rp->size < RECORD_MAGIC_LEN ||
+      memcmp (rp->data, RECORD_MAGIC, RECORD_MAGIC_LEN) != 0) {
+    replay_free (rp);
+    errno = EINVAL;
+    return NULL;
+  }
+  rp->pos = RECORD_MAGIC_LEN;
+
+  h = create_handle ();
+  if (h == NULL) {
+    err = errno;
+    replay_free (rp);
+    errno = err;
+    return NULL;
+  }
+  rp->due = now_ns ();
+  h->priv->replay = rp;
+  return h;
+}
+
+/* Make sure we are in a non-empty frame.  Returns 1 if so, 0 at the
+ * end of the recording, or -1 if the recording is truncated.
+ */
+static int
+replay_next_frame (struct mexp_replay *rp)
+{
+  uint32_t len;
+
+  while (!rp->in_frame || rp->pos == rp->frame_end) {
+    rp->in_frame = 0;
+    if (rp->pos == rp->size)
+      return 0;
+    if (rp->size - rp->pos < FRAME_HEADER_LEN)
+      goto truncated;
+    rp->due += (int64_t) get_le32 (rp->data + rp->pos) * 1000;
+    len = get_le32 (rp->data + rp->pos + 4);
+    rp->pos += FRAME_HEADER_LEN;
+    if (rp->size - rp->pos < len)
+      goto truncated;
+    rp->frame_end = rp->pos + len;
+    rp->in_frame = 1;
+  }
+  return 1;
+
+ truncated:
+  errno = EINVAL;
+  return -1;
+}
+
+/* The replay equivalent of read(2).  Like a pty, a large frame may
+ * be returned in several reads, but one read never spans two frames.
+ */
+static ssize_t
+replay_read (struct mexp_replay *rp, char *buf, size_t len)
+{
+  int r;
+
+  r = replay_next_frame (rp);
+  if (r <= 0)
+    return r;
+  if (len > rp->frame_end - rp->pos)
+    len = rp->frame_end - rp->pos;
+  memcpy (buf, rp->data + rp->pos, len);
+  rp->pos += len;
+  return len;
+}
+
+/* In realtime mode, sleep until the next frame is due.  Returns
+ * MEXP_TIMEOUT if it isn't due before end, else MEXP_CONTINUE.
+ */
+static int
+replay_wait (struct mexp_replay *rp, int64_t end)
+{
+  int64_t until;
+  struct timespec ts;
+  int timed_out = 0;
+
+  /* At the end of the recording, let the next read report it. */
+  if (!rp->realtime || replay_next_frame (rp) <= 0)
+    return MEXP_CONTINUE;
+
+  until = rp->due;
+  if (end >= 0 && until > end) {
+    until = end;
+    timed_out = 1;
+  }
+  ts.tv_sec = until / 1000000000;
+  ts.tv_nsec = until % 1000000000;
+  while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    ;
+  return timed_out ? MEXP_TIMEOUT : MEXP_CONTINUE;
+}
+
+/* Read once from the pty into the buffer, asking for read_size bytes.
+ * Returns the number of bytes read, or one of MEXP_EOF, MEXP_AGAIN,
+ * MEXP_BUFFER_FULL or MEXP_ERROR.
+ */
+static ssize_t
+read_once (mexp_h *h, const mexp_regexp *regexps, size_t read_size)
+{
+  ssize_t rs;
+
+  /* If the buffer would grow beyond the limit, first try to make
+   * room by dropping data that can no longer match.
+   */
+  if (h->max_buffer_size > 0 && h->len + read_size > h->max_buffer_size) {
+    trim_buffer (h, regexps);
+    if (h->len >= h->max_buffer_size)
+      return MEXP_BUFFER_FULL;
+    if (h->len + read_size > h->max_buffer_size)
+      read_size = h->max_buffer_size - h->len;
+  }
+
+  if (h->alloc - h->len < read_size) {
+    char *new_buffer;
+    size_t new_alloc;
+
+    /* Grow the buffer geometrically, but not beyond the limit. */
+    new_alloc = h->alloc * 2;
+    if (new_alloc < h->len + read_size)
+      new_alloc = h->len + read_size;
+    if (h->max_buffer_size > 0 && new_alloc > h->max_buffer_size)
+      new_alloc = h->max_buffer_size;
+    /* +1 here allows us to store \0 after the data read */
+    new_buffer = realloc (h->buffer, new_alloc + 1);
+    if (new_buffer == NULL)
+      return MEXP_ERROR;
+    h->buffer = new_buffer;
+    h->alloc = new_alloc;
+    h->priv->stats.reallocs++;
+  }
+  h->priv->stats.reads++;
+  if (h->priv->replay != NULL)
+    rs = replay_read (h->priv->replay, h->buffer + h->len, read_size);
+  else
+    rs = read (h->fd, h->buffer + h->len, read_size);
+  PROBE3 (read, h->pid, rs, h->len);
+  log_event (h, MEXP_LOG_READ, rs, rs > 0 ? h->buffer + h->len : NULL,
+             rs > 0 ? rs : 0);
+  if (h->debug_fp)
+    fprintf (h->debug_fp, "DEBUG: read returned %zd\n", rs);
+  if (rs == -1) {
+    /* Annoyingly on Linux (I'm fairly sure this is a bug) if the
+     * writer closes the connection, the entire pty is destroyed,
+     * and read returns -1 / EIO.  Handle that special case here.
+     */
+    if (errno == EIO)
+      return MEXP_EOF;
+    /* Nothing to read on a non-blocking fd. */
+    if (errno == EAGAIN)
+      return MEXP_AGAIN;
+    return MEXP_ERROR;
+  }
+  if (rs == 0)
+    return MEXP_EOF;
+
+  /* We read something. */
+  h->len += rs;
+  h->buffer[h->len] = '\0';
+  h->priv->stats.bytes_read += rs;
+  if (h->len > h->priv->stats.buffer_high_water)
+    h->priv->stats.buffer_high_water = h->len;
+  /* Print only the new data, not the whole buffer every time. */
+  if (h->debug_fp) {
+    fprintf (h->debug_fp, "DEBUG: read %zd bytes from pty: ", rs);
+    debug_buffer (h->debug_fp, h->buffer + h->len - rs, rs);
+    fprintf (h->debug_fp, "\n");
+  }
+
+  /* Copy everything we read to the sink before the matcher sees it,
+   * since the matcher may discard data.
+   */
+  if (h->sink_fd >= 0 || h->priv->record_fd >= 0)
+    write_outputs (h, h->buffer + h->len - rs, rs);
+
+  return rs;
+}
+
+/* MEXP_EXPECT_DRAIN: keep reading until the pty is empty or we have
+ * read h->drain_max bytes (but at least read_size), so that a fast
+ * producer costs one match pass per wakeup instead of one per
+ * read_size bytes.  The size of each read adapts to the data: it
+ * doubles while reads fill it, and halves when no read in a drain
+ * filled more than a quarter of it, but stays between read_size and
+ * the cap.
+ *
+ * Returns the number of bytes read, or as read_once.  *eof is set if
+ * the end of the data was seen after reading something, in which case
+ * the caller should match first and return MEXP_EOF after.
+ */
+static ssize_t
+read_drain (mexp_h *h, const mexp_regexp *regexps, int *eof)
+{
+  const size_t limit =
+    h->drain_max > h->read_size ? h->drain_max : h->read_size;
+  size_t read_size = h->priv->drain_read_size, total = 0, largest = 0;
+  ssize_t rs;
+
+  if (read_size < h->read_size)
+    read_size = h->read_size;
+  if (read_size > limit)
+    read_size = limit;
+
+  do {
+    rs = read_once (h, regexps,
+                    read_size < limit - total ? read_size : limit - total);
+    if (rs <= 0) {
+      if (total == 0)
+        return rs;
+      /* Match what we have.  A full buffer or an error will be seen
+       * again by the next read.
+       */
+      if (rs == MEXP_EOF)
+        *eof = 1;
+      break;
+    }
+    total += rs;
+    if ((size_t) rs > largest)
+      largest = rs;
+    if ((size_t) rs == read_size && read_size * 2 <= limit)
+      read_size *= 2;
+  } while (total < limit);
+
+  if (largest <= read_size / 4 && read_size / 2 >= h->read_size)
+    read_size /= 2;
+  h->priv->drain_read_size = read_size;
+  return total;
+}
+
+/* The pty is readable, so read from it and match.  Returns
+ * MEXP_CONTINUE if we have to read more data, else the result.
+ */
+static int
+expect_read (mexp_h *h, const mexp_regexp *regexps,
+             pcre2_match_data *match_data)
+{
+  ssize_t rs;
+  int eof = 0, r;
+
+  /* Draining needs O_NONBLOCK.  A replay is read from memory. */
+  if ((active_flags (h) & MEXP_EXPECT_DRAIN) && h->priv->replay == NULL &&
+      set_nonblocking (h) == 0)
+    rs = read_drain (h, regexps, &eof);
+  else
+    rs = read_once (h, regexps, h->read_size);
+  if (rs <= 0)
+    return rs;
+
+  r = expect_match (h, regexps, match_data);
+  if (r == MEXP_CONTINUE && eof)
+    return MEXP_EOF;
+  return r;
+}
+
+static int
+expect_wait (mexp_h *h, const mexp_regexp *regexps,
+             pcre2_match_data *match_data)
+{
+  int64_t end, now;
+  struct timespec ts, *timeout;
+  struct pollfd pfds[1];
+  int r;
+
+  end = expect_end (h);
+
+  r = expect_begin (h, regexps, match_data);
+  if (r != MEXP_CONTINUE)
+    return r;
+
+  for (;;) {
+    /* A replay is read straight from memory, without polling. */
+    if (h->priv->replay != NULL) {
+      r = replay_wait (h->priv->replay, end);
+      if (r != MEXP_CONTINUE)
+        return r;
+      r = expect_read (h, regexps, match_data);
+      if (r != MEXP_CONTINUE)
+        return r;
+      continue;
+    }
+
+    /* If we've got a timeout then work out how much time is left.
+     * Timeout == 0 is not particularly well-defined, but it probably
+     * means "return immediately if there's no data to be read".
+     */
+    if (end >= 0) {
+      now = now_ns ();
+      if (now > end)
+        now = end;
+      ts.tv_sec = (end - now) / 1000000000;
+      ts.tv_nsec = (end - now) % 1000000000;
+      timeout = &ts;
+    }
+    else
+      timeout = NULL;
+
+    /* Keep sending any queued data while we wait. */
+    pfds[0].fd = h->fd;
+    pfds[0].events = POLLIN | (h->priv->outq_len > 0 ? POLLOUT : 0);
+    pfds[0].revents = 0;
+    r = ppoll (pfds, 1, timeout, NULL);
+    PROBE3 (poll, h->pid, r, pfds[0].revents);
+    log_event (h, MEXP_LOG_POLL, r, NULL, 0);
+    if (h->debug_fp)
+      fprintf (h->debug_fp, "DEBUG: poll returned %d\n", r);
+    if (r == -1)
+      return MEXP_ERROR;
+
+    if (r == 0)
+      return MEXP_TIMEOUT;
+
+    h->priv->stats.wakeups++;
+    if (pfds[0].revents & POLLOUT)
+      send_queued (h);
+    if (pfds[0].revents & (POLLIN|POLLERR|POLLHUP)) {
+      r = expect_read (h, regexps, match_data);
+      if (r != MEXP_CONTINUE && r != MEXP_AGAIN)
+        return r;
+    }
+
+    /* A subprocess which never stops writing would keep ppoll from
+     * ever returning 0, so check the time here as well.
+     */
+    if (end >= 0 && now_ns () >= end)
+      return MEXP_TIMEOUT;
+  }
+}
+
+enum mexp_status
+mexp_expect (mexp_h *h, const mexp_regexp *regexps,
+             pcre2_match_data *match_data)
+{
+  h->priv->patterns = NULL;
+  return expect_done (h, expect_wait (h, regexps, match_data));
+}
+
+int
+mexp_expect_patterns (mexp_h *h, const mexp_patterns *p,
+                      pcre2_match_data *match_data)
+{
+  if (!p->compiled) {
+    errno = EINVAL;
+    return MEXP_ERROR;
+  }
+
+  /* Keep a match data block on the handle big enough for every
+   * pattern, so callers which don't want captures needn't allocate.
+   */
+  if (match_data == NULL) {
+    if (h->priv->patterns_match_data == NULL ||
+        pcre2_get_ovector_count (h->priv->patterns_match_data) < p->ovecsize) {
+      pcre2_match_data_free (h->priv->patterns_match_data);
+      h->priv->patterns_match_data = mexp_patterns_match_data_create (p);
+      if (h->priv->patterns_match_data == NULL) {
+        errno = ENOMEM;
+        return MEXP_ERROR;
+      }
+    }
+    match_data = h->priv->patterns_match_data;
+  }
+
+  h->priv->patterns = p;
+  return expect_done (h, expect_wait (h, p->regexps, match_data));
+}
+
+/* Make the fd non-blocking for mexp_expect_step, sets and draining. */
+static int
+set_nonblocking (mexp_h *h)
+{
+  int flags;
+
+  if (h->priv->nonblocking)
+    return 0;
+  /* A replay has no fd to wait on. */
+  if (h->priv->replay != NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+  flags = fcntl (h->fd, F_GETFL);
+  if (flags == -1 || fcntl (h->fd, F_SETFL, flags | O_NONBLOCK) == -1)
+    return -1;
+  h->priv->nonblocking = 1;
+  return 0;
+}
+
+int
+mexp_expect_start (mexp_h *h, const mexp_regexp *regexps,
+                   pcre2_match_data *match_data)
+{
+  int r;
+
+  if (set_nonblocking (h) == -1)
+    return MEXP_ERROR;
+
+  h->priv->patterns = NULL;
+  h->priv->step_regexps = regexps;
+  h->priv->step_match_data = match_data;
+  h->priv->step_end = expect_end (h);
+  h->priv->step_more = 0;
+  h->priv->stepping = 1;
+
+  r = expect_begin (h, regexps, match_data);
+  if (r == MEXP_CONTINUE)
+    return MEXP_AGAIN;
+  h->priv->stepping = 0;
+  return expect_done (h, r);
+}
+
+/* Maximum number of reads done by one call to mexp_expect_step. */
+#define MAX_STEP_READS 16
+
+int
+mexp_expect_step (mexp_h *h)
+{
+  int r = MEXP_CONTINUE;
+  unsigned i;
+
+  if (!h->priv->stepping) {
+    errno = EINVAL;
+    return MEXP_ERROR;
+  }
+
+  h->priv->stats.wakeups++;
+  if (h->priv->outq_len > 0)
+    send_queued (h);
+
+  /* Read what is available, but no more than MAX_STEP_READS times so
+   * that a fast subprocess can't starve the caller's event loop.  If
+   * we stop early there may be more to read, and since the event loop
+   * may be edge-triggered mexp_expect_timeout_ms then returns 0.
+   */
+  h->priv->step_more = 0;
+  for (i = 0; i < MAX_STEP_READS; ++i) {
+    r = expect_read (h, h->priv->step_regexps, h->priv->step_match_data);
+    if (r != MEXP_CONTINUE)
+      break;
+    if (h->priv->step_end >= 0 && now_ns () >= h->priv->step_end) {
+      r = MEXP_TIMEOUT;
+      break;
+    }
+  }
+  if (r == MEXP_CONTINUE) {
+    h->priv->step_more = 1;
+    return MEXP_AGAIN;
+  }
+
+  if (r == MEXP_AGAIN) {
+    if (h->priv->step_end >= 0 && now_ns () >= h->priv->step_end)
+      r = MEXP_TIMEOUT;
+    else
+      return MEXP_AGAIN;
+  }
+
+  h->priv->stepping = 0;
+  return expect_done (h, r);
+}
+
+int
+mexp_expect_timeout_ms (mexp_h *h)
+{
+  int64_t ns;
+
+  if (!h->priv->stepping)
+    return -1;
+  if (h->priv->step_more)
+    return 0;
+  if (h->priv->step_end == -1)
+    return -1;
+  ns = h->priv->step_end - now_ns ();
+  if (ns <= 0)
+    return 0;
+  if (ns >= (int64_t) INT_MAX * 1000000)
+    return INT_MAX;
+  /* Round up, so that waiting this long always reaches the deadline. */
+  return (ns + 999999) / 1000000;
+}
+
+/* A set of handles which are waited on together using epoll.  Each
+ * armed handle has its own regexps and its own timeout, and the
+ * timeouts are kept in a min-heap so the next one to expire is found
+ * in O(1).  Results are queued, since one epoll_wait can complete
+ * several handles.
+ */
+struct mexp_set_entry {
+  struct mexp_set *set;
+  mexp_h *h;
+  const mexp_regexp *regexps;
+  pcre2_match_data *match_data;
+  int armed;                    /* waiting for a result */
+  uint32_t events;              /* events registered in epoll */
+  int64_t end;                  /* timeout, or -1 */
+  size_t heap_index;            /* index in set->heap, or SIZE_MAX */
+  int result;                   /* result, while on the ready queue */
+  int err;                      /* errno for MEXP_ERROR */
+  int ready;                    /* on the ready queue */
+  struct mexp_set_entry *next_ready;
+  struct mexp_set_entry *prev, *next; /* all entries in the set */
+};
+
+#define MEXP_SET_EVENTS 64
+
+struct mexp_set {
+  int epfd;
+  struct mexp_set_entry *entries;
+  struct mexp_set_entry **heap; /* min-heap of armed entries by end */
+  size_t nr_heap, alloc_heap;
+  struct mexp_set_entry *ready_head, *ready_tail;
+  int wakefd;                   /* eventfd used by the runner, or -1 */
+  struct epoll_event events[MEXP_SET_EVENTS];
+};
+
+static void
+heap_swap (struct mexp_set *set, size_t i, size_t j)
+{
+  struct mexp_set_entry *t = set->heap[i];
+
+  set->heap[i] = set->heap[j];
+  set->heap[j] = t;
+  set->heap[i]->heap_index = i;
+  set->heap[j]->heap_index = j;
+}
+
+static void
+heap_fix (struct mexp_set *set, size_t i)
+{
+  /* Up. */
+  while (i > 0 && set->heap[i]->end < set->heap[(i-1)/2]->end) {
+    heap_swap (set, i, (i-1)/2);
+    i = (i-1)/2;
+  }
+  /* Down. */
+  for (;;) {
+    size_t l = 2*i + 1, r = l + 1, m = i;
+
+    if (l < set->nr_heap && set->heap[l]->end < set->heap[m]->end)
+      m = l;
+    if (r < set->nr_heap && set->heap[r]->end < set->heap[m]->end)
+      m = r;
+    if (m == i)
+      break;
+    heap_swap (set, i, m);
+    i = m;
+  }
+}
+
+static int
+heap_insert (struct mexp_set *set, struct mexp_set_entry *e)
+{
+  if (set->nr_heap == set->alloc_heap) {
+    struct mexp_set_entry **new_heap;
+    size_t new_alloc = set->alloc_heap ? set->alloc_heap * 2 : 16;
+
+    new_heap = realloc (set->heap, sizeof (struct mexp_set_entry *) * new_alloc);
+    if (new_heap == NULL)
+      return -1;
+    set->heap = new_heap;
+    set->alloc_heap = new_alloc;
+  }
+  e->heap_index = set->nr_heap;
+  set->heap[set->nr_heap++] = e;
+  heap_fix (set, e->heap_index);
+  return 0;
+}
+
+static void
+heap_remove (struct mexp_set *set, struct mexp_set_entry *e)
+{
+  size_t i = e->heap_index;
+
+  if (i == SIZE_MAX)
+    return;
+  e->heap_index = SIZE_MAX;
+  set->nr_heap--;
+  if (i < set->nr_heap) {
+    set->heap[i] = set->heap[set->nr_heap];
+    set->heap[i]->heap_index = i;
+    heap_fix (set, i);
+  }
+}
+
+/* Update the events we wait for on the handle's fd: input while
+ * armed, and output while there is data queued to send.  Handles
+ * with no events have to be removed, because EPOLLHUP is reported
+ * even with no events requested, and a pty whose subprocess has
+ * exited is always hung up.
+ */
+static int
+set_update (struct mexp_set *set, struct mexp_set_entry *e)
+{
+  struct epoll_event ev = { .events = 0, .data.ptr = e };
+  int op;
+
+  if (e->armed)
+    ev.events |= EPOLLIN;
+  if (e->h->priv->outq_len > 0)
+    ev.events |= EPOLLOUT;
+
+  if (ev.events == e->events)
+    return 0;
+  if (ev.events == 0)
+    op = EPOLL_CTL_DEL;
+  else if (e->events == 0)
+    op = EPOLL_CTL_ADD;
+  else
+    op = EPOLL_CTL_MOD;
+  if (epoll_ctl (set->epfd, op, e->h->fd, &ev) == -1)
+    return -1;
+  e->events = ev.events;
+  return 0;
+}
+
+/* Called by the send functions when the outgoing queue becomes empty
+ * or non-empty.
+ */
+static void
+set_update_handle (mexp_h *h)
+{
+  set_update (h->priv->set_entry->set, h->priv->set_entry);
+}
+
+/* The handle has a result, so disarm it and queue the result. */
+static void
+set_complete (struct mexp_set *set, struct mexp_set_entry *e, int r)
+{
+  e->err = errno;
+  expect_done (e->h, r);
+  e->armed = 0;
+  heap_remove (set, e);
+  set_update (set, e);
+  e->result = r;
+  e->ready = 1;
+  e->next_ready = NULL;
+  if (set->ready_tail)
+    set->ready_tail->next_ready = e;
+  else
+    set->ready_head = e;
+  set->ready_tail = e;
+}
+
+mexp_set *
+mexp_set_create (void)
+{
+  mexp_set *set;
+
+  set = calloc (1, sizeof *set);
+  if (set == NULL)
+    return NULL;
+  set->epfd = epoll_create1 (EPOLL_CLOEXEC);
+  if (set->epfd == -1) {
+    free (set);
+    return NULL;
+  }
+  set->wakefd = -1;
+  return set;
+}
+
+/* Make mexp_set_wait return 0 early when the non-blocking eventfd
+ * is written.  This is used by the runner to wake up its workers.
+ */
+static int
+set_add_wakeup (mexp_set *set, int fd)
+{
+  struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+
+  if (epoll_ctl (set->epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+    return -1;
+  set->wakefd = fd;
+  return 0;
+}
+
+void
+mexp_set_free (mexp_set *set)
+{
+  while (set->entries)
+    mexp_set_remove (set, set->entries->h);
+  close (set->epfd);
+  free (set->heap);
+  free (set);
+}
+
+int
+mexp_set_add (mexp_set *set, mexp_h *h, const mexp_regexp *regexps,
+              pcre2_match_data *match_data)
+{
+  struct mexp_set_entry *e = h->priv->set_entry;
+  int r;
+
+  if (h->priv->replay != NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (e == NULL) {
+    e = calloc (1, sizeof *e);
+    if (e == NULL)
+      return -1;
+    e->set = set;
+    e->h = h;
+    e->heap_index = SIZE_MAX;
+    e->next = set->entries;
+    if (set->entries)
+      set->entries->prev = e;
+    set->entries = e;
+    h->priv->set_entry = e;
+  }
+  else if (e->set != set) {
+    errno = EBUSY;
+    return -1;
+  }
+  else if (e->armed || e->ready) {
+    errno = EALREADY;
+    return -1;
+  }
+
+  /* One slow handle mustn't block the others. */
+  if (set_nonblocking (h) == -1)
+    return -1;
+
+  h->priv->patterns = NULL;
+  e->regexps = regexps;
+  e->match_data = match_data;
+  e->armed = 1;
+  e->end = expect_end (h);
+
+  /* There may already be a match in the buffer. */
+  r = expect_begin (h, regexps, match_data);
+  if (r != MEXP_CONTINUE) {
+    set_complete (set, e, r);
+    return 0;
+  }
+
+  if (e->end >= 0 && heap_insert (set, e) == -1) {
+    e->armed = 0;
+    return -1;
+  }
+  if (set_update (set, e) == -1) {
+    e->armed = 0;
+    heap_remove (set, e);
+    return -1;
+  }
+  return 0;
+}
+
+int
+mexp_set_remove (mexp_set *set, mexp_h *h)
+{
+  struct mexp_set_entry *e = h->priv->set_entry, **pp, *prev;
+
+  if (e == NULL || e->set != set) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  if (e->events != 0)
+    epoll_ctl (set->epfd, EPOLL_CTL_DEL, h->fd, NULL);
+  heap_remove (set, e);
+  if (e->ready) {
+    prev = NULL;
+    for (pp = &set->ready_head; *pp != e; pp = &(*pp)->next_ready)
+      prev = *pp;
+    *pp = e->next_ready;
+    if (set->ready_tail == e)
+      set->ready_tail = prev;
+  }
+  if (e->prev)
+    e->prev->next = e->next;
+  else
+    set->entries = e->next;
+  if (e->next)
+    e->next->prev = e->prev;
+  h->priv->set_entry = NULL;
+  free (e);
+  return 0;
+}
+
+/* Remove a handle which is being closed from its set. */
+static void
+set_detach (mexp_h *h)
+{
+  mexp_set_remove (h->priv->set_entry->set, h);
+}
+
+int
+mexp_set_wait (mexp_set *set, int timeout_ms, mexp_h **h_rtn, int *r_rtn)
+{
+  int64_t end = -1, now, wait_until;
+  int timeout, n, i, r, woken = 0;
+
+  if (timeout_ms >= 0)
+    end = now_ns () + (int64_t) timeout_ms * 1000000;
+
+  for (;;) {
+    /* Return a queued result first. */
+    if (set->ready_head) {
+      struct mexp_set_entry *e = set->ready_head;
+
+      set->ready_head = e->next_ready;
+      if (set->ready_head == NULL)
+        set->ready_tail = NULL;
+      e->ready = 0;
+      *h_rtn = e->h;
+      *r_rtn = e->result;
+      errno = e->err;
+      return 1;
+    }
+
+    /* Expire handles whose timeouts have passed. */
+    now = now_ns ();
+    while (set->nr_heap > 0 && set->heap[0]->end <= now)
+      set_complete (set, set->heap[0], MEXP_TIMEOUT);
+    if (set->ready_head)
+      continue;
+
+    /* Wait until the first of our timeout and the handles' timeouts,
+     * rounding up to a whole millisecond so we don't wake early.
+     */
+    wait_until = end;
+    if (set->nr_heap > 0 && (wait_until == -1 || set->heap[0]->end < wait_until))
+      wait_until = set->heap[0]->end;
+    if (wait_until == -1)
+      timeout = -1;
+    else if (wait_until <= now)
+      timeout = 0;
+    else if (wait_until - now >= (int64_t) INT_MAX * 1000000)
+      timeout = INT_MAX;
+    else
+      timeout = (wait_until - now + 999999) / 1000000;
+
+    n = epoll_wait (set->epfd, set->events, MEXP_SET_EVENTS, timeout);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+
+    for (i = 0; i < n; ++i) {
+      struct mexp_set_entry *e = set->events[i].data.ptr;
+      uint32_t events = set->events[i].events;
+
+      if (e == NULL) {
+        uint64_t v;
 
-static mexp_h *
-create_handle (void)
-{
-  mexp_h *h = malloc (sizeof *h);
-  if (h == NULL)
-    return NULL;
+        if (read (set->wakefd, &v, sizeof v) == -1 && errno != EAGAIN)
+          return -1;
+        woken = 1;
+        continue;
+      }
 
-  /* Initialize the fields to default values. */
-  h->fd = -1;
-  h->pid = 0;
-  h->timeout = 60000;
-  h->read_size = 1024;
-  h->pcre_error = 0;
-  h->buffer = NULL;
-  h->len = h->alloc = 0;
-  h->next_match = -1;
-  h->debug_fp = NULL;
-  h->user1 = h->user2 = h->user3 = NULL;
+      e->h->priv->stats.wakeups++;
+      PROBE3 (poll, e->h->pid, 1, events);
+      log_event (e->h, MEXP_LOG_POLL, 1, NULL, 0);
+      if (events & (EPOLLOUT|EPOLLERR|EPOLLHUP) && e->h->priv->outq_len > 0)
+        send_queued (e->h);
+      if (!e->armed || !(events & (EPOLLIN|EPOLLERR|EPOLLHUP)))
+        continue;
+      r = expect_read (e->h, e->regexps, e->match_data);
+      if (r != MEXP_CONTINUE && r != MEXP_AGAIN)
+        set_complete (set, e, r);
+    }
 
-  return h;
+    /* Check our timeout after every pass, since a handle with
+     * output which never matches could keep epoll_wait returning.
+     */
+    if (set->ready_head == NULL &&
+        (woken || (end >= 0 && now_ns () >= end)))
+      return 0;
+  }
 }
 
+/* The runner drives many sessions on a fixed pool of worker threads.
+ * Each worker has its own mexp_set, so reading and matching happen
+ * on the thread that owns the handle.  When a result arrives the
+ * handle is removed from the set and the session is put on the
+ * worker's run queue, where the session function is called to decide
+ * what to wait for next.  An idle worker steals sessions from the
+ * back of other workers' run queues, and the stolen handle then moves
+ * into the thief's set.  A handle is only ever in one set or one run
+ * queue, so it is only used by one thread at a time.
+ */
+struct mexp_runner_session {
+  mexp_h *h;
+  mexp_session_fn fn;
+  void *opaque;
+  pcre2_match_data *match_data; /* created by the first worker to run it */
+  int r;                        /* result to pass to fn */
+};
+
+struct runner_worker {
+  struct mexp_runner *runner;
+  pthread_t thread;
+  mexp_set *set;
+  int wakefd;
+  int idle;                     /* blocked in mexp_set_wait */
+  size_t nr_waiting;            /* sessions in the set */
+  pthread_mutex_t lock;         /* protects the run queue */
+  struct mexp_runner_session **q; /* run queue, a ring buffer */
+  size_t q_head, q_len, q_alloc;
+};
+
+struct mexp_runner {
+  unsigned nr_workers;
+  struct runner_worker *workers;
+  uint32_t ovecsize;
+  unsigned next_worker;         /* for spreading new sessions */
+  int stopping;
+  pthread_mutex_t lock;         /* protects nr_sessions */
+  pthread_cond_t done;
+  size_t nr_sessions;           /* sessions which haven't finished */
+};
+
 static void
-clear_buffer (mexp_h *h)
+runner_wake (struct runner_worker *w)
 {
-  free (h->buffer);
-  h->buffer = NULL;
-  h->alloc = h->len = 0;
-  h->next_match = -1;
+  const uint64_t one = 1;
+
+  if (write (w->wakefd, &one, sizeof one) == -1) {
+    /* EAGAIN means the counter is full, so it is already readable. */
+  }
 }
 
-int
-mexp_close (mexp_h *h)
+static int
+runner_push (struct runner_worker *w, struct mexp_runner_session *s)
 {
-  int status = 0;
+  pthread_mutex_lock (&w->lock);
+  if (w->q_len == w->q_alloc) {
+    size_t new_alloc = w->q_alloc ? w->q_alloc * 2 : 64, i;
+    struct mexp_runner_session **new_q;
 
-  free (h->buffer);
-
-  if (h->fd >= 0)
-    close (h->fd);
-  if (h->pid > 0) {
-    if (waitpid (h->pid, &status, 0) == -1)
+    new_q = malloc (new_alloc * sizeof *new_q);
+    if (new_q == NULL) {
+      pthread_mutex_unlock (&w->lock);
       return -1;
+    }
+    for (i = 0; i < w->q_len; ++i)
+      new_q[i] = w->q[(w->q_head + i) % w->q_alloc];
+    free (w->q);
+    w->q = new_q;
+    w->q_head = 0;
+    w->q_alloc = new_alloc;
   }
-
-  free (h);
-
-  return status;
+  w->q[(w->q_head + w->q_len) % w->q_alloc] = s;
+  w->q_len++;
+  pthread_mutex_unlock (&w->lock);
+  return 0;
 }
 
-mexp_h *
-mexp_spawnlf (unsigned flags, const char *file, const char *arg, ...)
+/* The owner takes sessions from the front of its run queue, and
+ * thieves from the back.
+ */
+static struct mexp_runner_session *
+runner_pop (struct runner_worker *w, int steal)
 {
-  char **argv, **new_argv;
-  size_t i;
-  va_list args;
-  mexp_h *h;
-
-  argv = malloc (sizeof (char *));
-  if (argv == NULL)
-    return NULL;
-  argv[0] = (char *) arg;
+  struct mexp_runner_session *s = NULL;
 
-  va_start (args, arg);
-  for (i = 1; arg != NULL; ++i) {
-    arg = va_arg (args, const char *);
-    new_argv = realloc (argv, sizeof (char *) * (i+1));
-    if (new_argv == NULL) {
-      free (argv);
-      va_end (args);
-      return NULL;
+  pthread_mutex_lock (&w->lock);
+  if (w->q_len > 0) {
+    if (steal)
+      s = w->q[(w->q_head + w->q_len - 1) % w->q_alloc];
+    else {
+      s = w->q[w->q_head];
+      w->q_head = (w->q_head + 1) % w->q_alloc;
     }
-    argv = new_argv;
-    argv[i] = (char *) arg;
+    w->q_len--;
   }
+  pthread_mutex_unlock (&w->lock);
+  return s;
+}
 
-  h = mexp_spawnvf (flags, file, argv);
-  free (argv);
-  va_end (args);
-  return h;
+static struct mexp_runner_session *
+runner_steal (struct runner_worker *w)
+{
+  struct mexp_runner *runner = w->runner;
+  const size_t self = w - runner->workers;
+  struct mexp_runner_session *s;
+  unsigned i;
+
+  for (i = 1; i < runner->nr_workers; ++i) {
+    s = runner_pop (&runner->workers[(self + i) % runner->nr_workers], 1);
+    if (s)
+      return s;
+  }
+  return NULL;
 }
 
-mexp_h *
-mexp_spawnvf (unsigned flags, const char *file, char **argv)
+/* Call the session function, and wait for whatever it asks for. */
+static void
+runner_run (struct runner_worker *w, struct mexp_runner_session *s)
 {
-  mexp_h *h = NULL;
-  int fd = -1;
-  int err;
-  char slave[1024];
-  pid_t pid = 0;
+  struct mexp_runner *runner = w->runner;
+  const mexp_regexp *regexps;
 
-  fd = posix_openpt (O_RDWR|O_NOCTTY);
-  if (fd == -1)
-    goto error;
+  if (s->match_data == NULL) {
+    s->match_data = pcre2_match_data_create (runner->ovecsize, NULL);
+    if (s->match_data == NULL)
+      s->r = MEXP_ERROR;
+  }
 
-  if (grantpt (fd) == -1)
-    goto error;
+  for (;;) {
+    regexps = s->fn (s->h, s->r, s->match_data, s->opaque);
+    if (regexps == NULL) {
+      /* The session has finished.  The function may have closed h. */
+      pcre2_match_data_free (s->match_data);
+      free (s);
+      pthread_mutex_lock (&runner->lock);
+      if (--runner->nr_sessions == 0)
+        pthread_cond_broadcast (&runner->done);
+      pthread_mutex_unlock (&runner->lock);
+      return;
+    }
 
-  if (unlockpt (fd) == -1)
-    goto error;
+    s->h->priv->runner_session = s;
+    if (mexp_set_add (w->set, s->h, regexps, s->match_data) == 0) {
+      w->nr_waiting++;
+      return;
+    }
+    s->r = MEXP_ERROR;
+    if (runner_push (w, s) == 0)
+      return;
+    /* Out of memory, so all we can do is call fn again now, until
+     * it gives up.
+     */
+  }
+}
 
-  /* Get the slave pty name now, but don't open it in the parent. */
-  if (ptsname_r (fd, slave, sizeof slave) != 0)
-    goto error;
+static void *
+runner_main (void *arg)
+{
+  struct runner_worker *w = arg;
+  struct mexp_runner *runner = w->runner;
+  struct mexp_runner_session *s;
+  mexp_h *h;
+  int r, ret;
+  size_t n;
+  unsigned i;
 
-  /* Create the handle last before we fork. */
-  h = create_handle ();
-  if (h == NULL)
-    goto error;
+  for (;;) {
+    s = runner_pop (w, 0);
+    if (s == NULL)
+      s = runner_steal (w);
+    if (s != NULL) {
+      runner_run (w, s);
+      continue;
+    }
 
-  pid = fork ();
-  if (pid == -1)
-    goto error;
+    if (w->nr_waiting == 0 && __atomic_load_n (&runner->stopping,
+                                               __ATOMIC_ACQUIRE))
+      return NULL;
 
-  if (pid == 0) {               /* Child. */
-    int slave_fd;
+    /* Wait for results, or to be woken up for new sessions. */
+    __atomic_store_n (&w->idle, 1, __ATOMIC_SEQ_CST);
+    ret = mexp_set_wait (w->set, -1, &h, &r);
+    __atomic_store_n (&w->idle, 0, __ATOMIC_SEQ_CST);
 
-    if (!(flags & MEXP_SPAWN_KEEP_SIGNALS)) {
-      struct sigaction sa;
-      int i;
+    /* Move all the results to the run queue. */
+    n = 0;
+    while (ret == 1) {
+      s = h->priv->runner_session;
+      mexp_set_remove (w->set, h);
+      w->nr_waiting--;
+      s->r = r;
+      if (runner_push (w, s) == -1)
+        runner_run (w, s);
+      else
+        n++;
+      ret = mexp_set_wait (w->set, 0, &h, &r);
+    }
 
-      /* Remove all signal handlers.  See the justification here:
-       * https://www.redhat.com/archives/libvir-list/2008-August/msg00303.html
-       * We don't mask signal handlers yet, so this isn't completely
-       * race-free, but better than not doing it at all.
-       */
-      memset (&sa, 0, sizeof sa);
-      sa.sa_handler = SIG_DFL;
-      sa.sa_flags = 0;
-      sigemptyset (&sa.sa_mask);
-      for (i = 1; i < NSIG; ++i)
-        sigaction (i, &sa, NULL);
+    /* If there is more than we can do at once, wake an idle worker
+     * to steal some.
+     */
+    if (n > 1) {
+      for (i = 0; i < runner->nr_workers; ++i) {
+        if (__atomic_load_n (&runner->workers[i].idle, __ATOMIC_SEQ_CST)) {
+          runner_wake (&runner->workers[i]);
+          break;
+        }
+      }
     }
+  }
+}
 
-    setsid ();
+static void
+runner_destroy (mexp_runner *runner, unsigned nr_started)
+{
+  unsigned i;
 
-    /* Open the slave side of the pty.  We must do this in the child
-     * after setsid so it becomes our controlling tty.
-     */
-    slave_fd = open (slave, O_RDWR);
-    if (slave_fd == -1)
-      goto error;
+  __atomic_store_n (&runner->stopping, 1, __ATOMIC_RELEASE);
+  for (i = 0; i < nr_started; ++i)
+    runner_wake (&runner->workers[i]);
+  for (i = 0; i < nr_started; ++i)
+    pthread_join (runner->workers[i].thread, NULL);
 
-    if (!(flags & MEXP_SPAWN_COOKED_MODE)) {
-      struct termios termios;
+  for (i = 0; i < runner->nr_workers; ++i) {
+    struct runner_worker *w = &runner->workers[i];
 
-      /* Set raw mode. */
-      tcgetattr (slave_fd, &termios);
-      cfmakeraw (&termios);
-      tcsetattr (slave_fd, TCSANOW, &termios);
-    }
+    if (w->set)
+      mexp_set_free (w->set);
+    if (w->wakefd >= 0)
+      close (w->wakefd);
+    pthread_mutex_destroy (&w->lock);
+    free (w->q);
+  }
+  pthread_mutex_destroy (&runner->lock);
+  pthread_cond_destroy (&runner->done);
+  free (runner->workers);
+  free (runner);
+}
 
-    /* Set up stdin, stdout, stderr to point to the pty. */
-    dup2 (slave_fd, 0);
-    dup2 (slave_fd, 1);
-    dup2 (slave_fd, 2);
-    close (slave_fd);
+mexp_runner *
+mexp_runner_create (unsigned nr_threads, uint32_t ovecsize)
+{
+  mexp_runner *runner;
+  unsigned i;
+  int err;
 
-    /* Close the master side of the pty - do this late to avoid a
-     * kernel bug, see sshpass source code.
-     */
-    close (fd);
+  if (nr_threads == 0) {
+    long n = sysconf (_SC_NPROCESSORS_ONLN);
 
-    if (!(flags & MEXP_SPAWN_KEEP_FDS)) {
-      int i, max_fd;
+    nr_threads = n > 0 ? n : 1;
+  }
 
-      /* Close all other file descriptors.  This ensures that we don't
-       * hold open (eg) pipes from the parent process.
-       */
-      max_fd = sysconf (_SC_OPEN_MAX);
-      if (max_fd == -1)
-        max_fd = 1024;
-      if (max_fd > 65536)
-        max_fd = 65536;      /* bound the amount of work we do here */
-      for (i = 3; i < max_fd; ++i)
-        close (i);
-    }
-
-    /* Run the subprocess. */
-    execvp (file, argv);
-    perror (file);
-    _exit (EXIT_FAILURE);
+  runner = calloc (1, sizeof *runner);
+  if (runner == NULL)
+    return NULL;
+  runner->workers = calloc (nr_threads, sizeof *runner->workers);
+  if (runner->workers == NULL) {
+    free (runner);
+    return NULL;
   }
+  runner->nr_workers = nr_threads;
+  runner->ovecsize = ovecsize;
+  pthread_mutex_init (&runner->lock, NULL);
+  pthread_cond_init (&runner->done, NULL);
 
-  /* Parent. */
+  for (i = 0; i < nr_threads; ++i) {
+    runner->workers[i].runner = runner;
+    runner->workers[i].wakefd = -1;
+    pthread_mutex_init (&runner->workers[i].lock, NULL);
+  }
 
-  h->fd = fd;
-  h->pid = pid;
-  return h;
+  for (i = 0; i < nr_threads; ++i) {
+    struct runner_worker *w = &runner->workers[i];
+
+    w->wakefd = eventfd (0, EFD_NONBLOCK|EFD_CLOEXEC);
+    w->set = mexp_set_create ();
+    if (w->wakefd == -1 || w->set == NULL ||
+        set_add_wakeup (w->set, w->wakefd) == -1)
+      goto error;
+  }
+
+  for (i = 0; i < nr_threads; ++i) {
+    err = pthread_create (&runner->workers[i].thread, NULL,
+                          runner_main, &runner->workers[i]);
+    if (err != 0) {
+      runner_destroy (runner, i);
+      errno = err;
+      return NULL;
+    }
+  }
+
+  return runner;
 
  error:
   err = errno;
-  if (fd >= 0)
-    close (fd);
-  if (pid > 0)
-    waitpid (pid, NULL, 0);
-  if (h != NULL)
-    mexp_close (h);
+  runner_destroy (runner, 0);
   errno = err;
   return NULL;
 }
 
-enum mexp_status
-mexp_expect (mexp_h *h, const mexp_regexp *regexps,
-             pcre2_match_data *match_data)
+int
+mexp_runner_add (mexp_runner *runner, mexp_h *h,
+                 mexp_session_fn fn, void *opaque)
 {
-  time_t start_t, now_t;
-  int timeout;
-  struct pollfd pfds[1];
-  int r;
-  ssize_t rs;
+  struct mexp_runner_session *s;
+  struct runner_worker *w;
 
-  time (&start_t);
+  s = calloc (1, sizeof *s);
+  if (s == NULL)
+    return -1;
+  s->h = h;
+  s->fn = fn;
+  s->opaque = opaque;
+  s->r = MEXP_AGAIN;
 
-  if (h->next_match == -1) {
-    /* Fully clear the buffer, then read. */
-    clear_buffer (h);
-  } else {
-    /* See the comment in the manual about h->next_match.  We have
-     * some data remaining in the buffer, so begin by matching that.
-     */
-    memmove (&h->buffer[0], &h->buffer[h->next_match], h->len - h->next_match);
-    h->len -= h->next_match;
-    h->buffer[h->len] = '\0';
-    h->next_match = -1;
-    goto try_match;
+  pthread_mutex_lock (&runner->lock);
+  runner->nr_sessions++;
+  pthread_mutex_unlock (&runner->lock);
+
+  w = &runner->workers[__atomic_fetch_add (&runner->next_worker, 1,
+                                           __ATOMIC_RELAXED)
+                       % runner->nr_workers];
+  if (runner_push (w, s) == -1) {
+    pthread_mutex_lock (&runner->lock);
+    runner->nr_sessions--;
+    pthread_mutex_unlock (&runner->lock);
+    free (s);
+    return -1;
   }
+  runner_wake (w);
+  return 0;
+}
 
-  for (;;) {
-    /* If we've got a timeout then work out how many seconds are left.
-     * Timeout == 0 is not particularly well-defined, but it probably
-     * means "return immediately if there's no data to be read".
-     */
-    if (h->timeout >= 0) {
-      time (&now_t);
-      timeout = h->timeout - ((now_t - start_t) * 1000);
-      if (timeout < 0)
-        timeout = 0;
-    }
-    else
-      timeout = 0;
+void
+mexp_runner_wait (mexp_runner *runner)
+{
+  pthread_mutex_lock (&runner->lock);
+  while (runner->nr_sessions > 0)
+    pthread_cond_wait (&runner->done, &runner->lock);
+  pthread_mutex_unlock (&runner->lock);
+}
 
-    pfds[0].fd = h->fd;
-    pfds[0].events = POLLIN;
-    pfds[0].revents = 0;
-    r = poll (pfds, 1, timeout);
-    if (h->debug_fp)
-      fprintf (h->debug_fp, "DEBUG: poll returned %d\n", r);
-    if (r == -1)
-      return MEXP_ERROR;
+void
+mexp_runner_free (mexp_runner *runner)
+{
+  mexp_runner_wait (runner);
+  runner_destroy (runner, runner->nr_workers);
+}
 
-    if (r == 0)
-      return MEXP_TIMEOUT;
+/* Add data which couldn't be written yet to the outgoing queue. */
+static int
+queue_append (mexp_h *h, const char *buf, size_t len)
+{
+  if (h->priv->outq_start > 0 &&
+      h->priv->outq_len + len > h->priv->outq_alloc) {
+    /* Move the unsent data to the start before growing. */
+    memmove (h->priv->outq, h->priv->outq + h->priv->outq_start,
+             h->priv->outq_len - h->priv->outq_start);
+    h->priv->outq_len -= h->priv->outq_start;
+    h->priv->outq_start = 0;
+  }
+  if (h->priv->outq_len + len > h->priv->outq_alloc) {
+    char *new_outq;
+    size_t new_alloc = h->priv->outq_alloc ? h->priv->outq_alloc * 2 : 1024;
 
-    /* Otherwise we expect there is something to read from the file
-     * descriptor.
-     */
-    if (h->alloc - h->len <= h->read_size) {
-      char *new_buffer;
-      /* +1 here allows us to store \0 after the data read */
-      new_buffer = realloc (h->buffer, h->alloc + h->read_size + 1);
-      if (new_buffer == NULL)
-        return MEXP_ERROR;
-      h->buffer = new_buffer;
-      h->alloc += h->read_size;
+    if (new_alloc < h->priv->outq_len + len)
+      new_alloc = h->priv->outq_len + len;
+    new_outq = realloc (h->priv->outq, new_alloc);
+    if (new_outq == NULL)
+      return -1;
+    h->priv->outq = new_outq;
+    h->priv->outq_alloc = new_alloc;
+  }
+  memcpy (h->priv->outq + h->priv->outq_len, buf, len);
+  h->priv->outq_len += len;
+  return 0;
+}
+
+int
+mexp_flush (mexp_h *h)
+{
+  ssize_t r;
+
+  while (h->priv->outq_start < h->priv->outq_len) {
+    r = write (h->fd, h->priv->outq + h->priv->outq_start,
+               h->priv->outq_len - h->priv->outq_start);
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN)
+        break;
+      return -1;
     }
-    rs = read (h->fd, h->buffer + h->len, h->read_size);
+    h->priv->outq_start += r;
+  }
+
+  if (h->priv->outq_start == h->priv->outq_len) {
+    h->priv->outq_start = h->priv->outq_len = 0;
+    if (h->priv->set_entry != NULL)
+      set_update_handle (h);
+  }
+  return h->priv->outq_len - h->priv->outq_start;
+}
+
+/* Flush the outgoing queue from an expect loop.  If the pty can't be
+ * written, the subprocess has probably gone away, which the caller
+ * will find out by reading, so just drop the data.
+ */
+static void
+send_queued (mexp_h *h)
+{
+  if (mexp_flush (h) == -1) {
     if (h->debug_fp)
-      fprintf (h->debug_fp, "DEBUG: read returned %zd\n", rs);
-    if (rs == -1) {
-      /* Annoyingly on Linux (I'm fairly sure this is a bug) if the
-       * writer closes the connection, the entire pty is destroyed,
-       * and read returns -1 / EIO.  Handle that special case here.
-       */
-      if (errno == EIO)
-        return MEXP_EOF;
-      return MEXP_ERROR;
-    }
-    if (rs == 0)
-      return MEXP_EOF;
+      fprintf (h->debug_fp, "DEBUG: dropping %zu queued bytes: %m\n",
+               h->priv->outq_len - h->priv->outq_start);
+    h->priv->outq_start = h->priv->outq_len = 0;
+    if (h->priv->set_entry != NULL)
+      set_update_handle (h);
+  }
+}
+
+/* Write data to the pty.  On a blocking fd, this writes everything.
+ * On a non-blocking fd, whatever cannot be written now is added to
+ * the outgoing queue, which is flushed as the pty becomes writable.
+ */
+static ssize_t
+send_iov (mexp_h *h, int password, const struct iovec *iov, int iovcnt)
+{
+  size_t total = 0, off = 0;
+  ssize_t r;
+  int i;
+
+  for (i = 0; i < iovcnt; ++i)
+    total += iov[i].iov_len;
 
-    /* We read something. */
-    h->len += rs;
-    h->buffer[h->len] = '\0';
-    if (h->debug_fp) {
-      fprintf (h->debug_fp, "DEBUG: read %zd bytes from pty\n", rs);
-      fprintf (h->debug_fp, "DEBUG: buffer content: ");
-      debug_buffer (h->debug_fp, h->buffer);
+  if (h->debug_fp) {
+    if (!password) {
+      fprintf (h->debug_fp, "DEBUG: writing: ");
+      for (i = 0; i < iovcnt; ++i)
+        debug_buffer (h->debug_fp, iov[i].iov_base, iov[i].iov_len);
       fprintf (h->debug_fp, "\n");
     }
+    else
+      fprintf (h->debug_fp, "DEBUG: writing the password\n");
+  }
 
-  try_match:
-    /* See if there is a full or partial match against any regexp. */
-    if (regexps) {
-      size_t i;
-      int can_clear_buffer = 1;
-
-      assert (h->buffer != NULL);
+  /* Only the size is traced, never the data. */
+  PROBE3 (send, h->pid, total, password);
+  if (password)
+    log_event (h, MEXP_LOG_SEND, 1, NULL, total);
+  else {
+    for (i = 0; i < iovcnt; ++i)
+      log_event (h, MEXP_LOG_SEND, 0, iov[i].iov_base, iov[i].iov_len);
+  }
 
-      for (i = 0; regexps[i].r > 0; ++i) {
-        const int options = regexps[i].options | PCRE2_PARTIAL_SOFT;
+  /* A replay doesn't depend on what is sent, so discard it. */
+  if (h->priv->replay != NULL)
+    return total;
 
-        r = pcre2_match (regexps[i].re,
-                         (PCRE2_SPTR) h->buffer, (int)h->len, 0,
-                         options, match_data, NULL);
-        h->pcre_error = r;
+  /* Data must go out in order, so flush the queue first. */
+  if (h->priv->outq_len > 0 && mexp_flush (h) == -1)
+    return -1;
 
-        if (r >= 0) {
-          /* A full match. */
-          const PCRE2_SIZE *ovector = NULL;
+  i = 0;
+  while (i < iovcnt && h->priv->outq_len == 0) {
+    if (iov[i].iov_len == off) {
+      i++;
+      off = 0;
+      continue;
+    }
+    if (off == 0)
+      r = writev (h->fd, &iov[i], iovcnt - i < IOV_MAX ? iovcnt - i : IOV_MAX);
+    else
+      r = write (h->fd, (char *) iov[i].iov_base + off, iov[i].iov_len - off);
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN)
+        break;
+      return -1;
+    }
+    /* Skip over what was written. */
+    while (i < iovcnt && (size_t) r >= iov[i].iov_len - off) {
+      r -= iov[i].iov_len - off;
+      i++;
+      off = 0;
+    }
+    off += r;
+  }
 
-          if (match_data)
-            ovector = pcre2_get_ovector_pointer (match_data);
+  /* Queue the rest. */
+  for (; i < iovcnt; ++i, off = 0) {
+    if (queue_append (h, (char *) iov[i].iov_base + off,
+                      iov[i].iov_len - off) == -1)
+      return -1;
+  }
+  if (h->priv->outq_len > 0 && h->priv->set_entry != NULL)
+    set_update_handle (h);
 
-          if (ovector != NULL && ovector[1] != ~(PCRE2_SIZE)0)
-            h->next_match = ovector[1];
-          else
-            h->next_match = -1;
-          if (h->debug_fp)
-            fprintf (h->debug_fp, "DEBUG: next_match at buffer offset %zu\n",
-                     h->next_match);
-          return regexps[i].r;
-        }
+  return total;
+}
 
-        else if (r == PCRE2_ERROR_NOMATCH) {
-          /* No match at all. */
-          /* (nothing here) */
-        }
+ssize_t
+mexp_send (mexp_h *h, const void *buf, size_t len)
+{
+  struct iovec iov = { .iov_base = (void *) buf, .iov_len = len };
 
-        else if (r == PCRE2_ERROR_PARTIAL) {
-          /* Partial match.  Keep the buffer and keep reading. */
-          can_clear_buffer = 0;
-        }
+  return send_iov (h, 0, &iov, 1);
+}
 
-        else {
-          /* An actual PCRE error. */
-          return MEXP_PCRE_ERROR;
-        }
-      }
+ssize_t
+mexp_send_password (mexp_h *h, const void *buf, size_t len)
+{
+  struct iovec iov = { .iov_base = (void *) buf, .iov_len = len };
 
-      /* If none of the regular expressions matched (not partially)
-       * then we can clear the buffer.  This is an optimization.
-       */
-      if (can_clear_buffer)
-        clear_buffer (h);
+  return send_iov (h, 1, &iov, 1);
+}
 
-    } /* if (regexps) */
-  }
+ssize_t
+mexp_sendv (mexp_h *h, const struct iovec *iov, int iovcnt)
+{
+  return send_iov (h, 0, iov, iovcnt);
 }
 
 static int mexp_vprintf (mexp_h *h, int password, const char *fs, va_list args)
@@ -398,40 +4513,33 @@ static int mexp_vprintf (mexp_h *h, int password, const char *fs, va_list args)
 static int
 mexp_vprintf (mexp_h *h, int password, const char *fs, va_list args)
 {
-  char *msg;
+  char buf[256];
+  char *msg = buf;
   int len;
-  size_t n;
-  ssize_t r;
-  char *p;
-
-  len = vasprintf (&msg, fs, args);
+  va_list args2;
+  struct iovec iov;
 
+  /* Most messages are short, so try to format into a buffer on the
+   * stack first.
+   */
+  va_copy (args2, args);
+  len = vsnprintf (buf, sizeof buf, fs, args2);
+  va_end (args2);
   if (len < 0)
     return -1;
-
-  if (h->debug_fp) {
-    if (!password) {
-      fprintf (h->debug_fp, "DEBUG: writing: ");
-      debug_buffer (h->debug_fp, msg);
-      fprintf (h->debug_fp, "\n");
-    }
-    else
-      fprintf (h->debug_fp, "DEBUG: writing the password\n");
-  }
-
-  n = len;
-  p = msg;
-  while (n > 0) {
-    r = write (h->fd, p, n);
-    if (r == -1) {
-      free (msg);
+  if ((size_t) len >= sizeof buf) {
+    len = vasprintf (&msg, fs, args);
+    if (len < 0)
       return -1;
-    }
-    n -= r;
-    p += r;
   }
 
-  free (msg);
+  iov.iov_base = msg;
+  iov.iov_len = len;
+  if (send_iov (h, password, &iov, 1) == -1)
+    len = -1;
+
+  if (msg != buf)
+    free (msg);
   return len;
 }
 
@@ -462,30 +4570,47 @@ mexp_printf_password (mexp_h *h, const char *fs, ...)
 int
 mexp_send_interrupt (mexp_h *h)
 {
-  return write (h->fd, "\003", 1);
+  return mexp_send (h, "\003", 1);
 }
 
 /* Print escaped buffer to fp. */
 static void
-debug_buffer (FILE *fp, const char *buf)
+debug_buffer (FILE *fp, const char *buf, size_t len)
 {
-  while (*buf) {
-    if (isprint (*buf))
-      fputc (*buf, fp);
-    else {
-      switch (*buf) {
-      case '\0': fputs ("\\0", fp); break;
-      case '\a': fputs ("\\a", fp); break;
-      case '\b': fputs ("\\b", fp); break;
-      case '\f': fputs ("\\f", fp); break;
-      case '\n': fputs ("\\n", fp); break;
-      case '\r': fputs ("\\r", fp); break;
-      case '\t': fputs ("\\t", fp); break;
-      case '\v': fputs ("\\v", fp); break;
-      default:
-        fprintf (fp, "\\x%x", (unsigned char) *buf);
-      }
+  static const char hex[] = "0123456789abcdef";
+  const unsigned char *p = (const unsigned char *) buf;
+  const unsigned char *end = p + len;
+  char out[1024];
+  size_t n = 0;
+
+  /* Escape into a local buffer, and write it out in large pieces.
+   * Each byte becomes at most 4 characters.
+   */
+  for (; p < end; ++p) {
+    if (n > sizeof out - 4) {
+      fwrite (out, 1, n, fp);
+      n = 0;
+    }
+    if (isprint (*p)) {
+      out[n++] = *p;
+      continue;
+    }
+    out[n++] = '\\';
+    switch (*p) {
+    case '\0': out[n++] = '0'; break;
+    case '\a': out[n++] = 'a'; break;
+    case '\b': out[n++] = 'b'; break;
+    case '\f': out[n++] = 'f'; break;
+    case '\n': out[n++] = 'n'; break;
+    case '\r': out[n++] = 'r'; break;
+    case '\t': out[n++] = 't'; break;
+    case '\v': out[n++] = 'v'; break;
+    default:
+      out[n++] = 'x';
+      if (*p >= 16)
+        out[n++] = hex[*p >> 4];
+      out[n++] = hex[*p & 15];
     }
-    buf++;
   }
+  fwrite (out, 1, n, fp);
 }
@@ -30,11 +30,53 @@
 #define MINIEXPECT_H_
 
 #include <stdio.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <sys/uio.h>
 
 #define PCRE2_CODE_UNIT_WIDTH 8
 #include <pcre2.h>
 
+/* Performance counters, kept for each handle. */
+struct mexp_stats {
+  uint64_t expects;             /* results returned by expect calls */
+  uint64_t wakeups;             /* poll or epoll wakeups */
+  uint64_t reads;               /* calls to read(2) */
+  uint64_t bytes_read;
+  uint64_t matches;             /* calls to pcre2_match or pcre2_dfa_match */
+  uint64_t match_ns;            /* time spent matching */
+  uint64_t reallocs;            /* times the buffer was grown */
+  size_t buffer_high_water;     /* most data held in the buffer */
+};
+
+/* Histogram of the time taken by expect calls returning r. */
+#define MEXP_HISTOGRAM_BUCKETS 32
+struct mexp_histogram {
+  int r;
+  uint64_t count;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  uint64_t buckets[MEXP_HISTOGRAM_BUCKETS];
+};
+
+/* Events passed to the log callback. */
+#define MEXP_LOG_POLL   1
+#define MEXP_LOG_READ   2
+#define MEXP_LOG_RESULT 3
+#define MEXP_LOG_SEND   4
+
+struct mexp_log_event {
+  int type;                     /* MEXP_LOG_* */
+  pid_t pid;
+  int r;                        /* poll, read or expect result */
+  const char *data;             /* bytes read or sent, or NULL */
+  size_t len;
+  uint64_t dropped;             /* events dropped before this one */
+};
+
+struct mexp_h;
+typedef void (*mexp_log_callback) (struct mexp_h *h, const struct mexp_log_event *event, void *opaque);
+
 /* This handle is created per subprocess that is spawned. */
 struct mexp_h {
   int fd;
@@ -50,6 +92,18 @@ struct mexp_h {
   void *user1;
   void *user2;
   void *user3;
+
+  /* Fields read and written by the macros below. */
+  size_t max_buffer_size;
+  size_t drain_max;
+  unsigned expect_flags;
+  int jit_used;
+  int sink_fd;
+  int sink_error;
+  int record_error;
+
+  /* Everything else is private to the library. */
+  struct mexp_handle_private *priv;
 };
 typedef struct mexp_h mexp_h;
 
@@ -62,11 +116,29 @@ typedef struct mexp_h mexp_h;
  * code handles this since it only checks for h->timeout < 0.
  */
 #define mexp_set_timeout(h, secs) ((h)->timeout = 1000 * (secs))
+extern void mexp_set_deadline_ms (mexp_h *h, int ms);
+extern int mexp_get_deadline_ms (mexp_h *h);
 #define mexp_get_read_size(h) ((h)->read_size)
 #define mexp_set_read_size(h, size) ((h)->read_size = (size))
+#define mexp_get_max_buffer_size(h) ((h)->max_buffer_size)
+#define mexp_set_max_buffer_size(h, size) ((h)->max_buffer_size = (size))
+#define mexp_get_drain_max(h) ((h)->drain_max)
+#define mexp_set_drain_max(h, size) ((h)->drain_max = (size))
+#define mexp_get_expect_flags(h) ((h)->expect_flags)
+#define mexp_set_expect_flags(h, flags) ((h)->expect_flags = (flags))
 #define mexp_get_pcre_error(h) ((h)->pcre_error)
+#define mexp_get_jit_used(h) ((h)->jit_used)
 #define mexp_set_debug_file(h, fp) ((h)->debug_fp = (fp))
 #define mexp_get_debug_file(h) ((h)->debug_fp)
+#define mexp_set_sink_fd(h, fd) ((h)->sink_error = 0, (h)->sink_fd = (fd))
+#define mexp_get_sink_fd(h) ((h)->sink_fd)
+#define mexp_get_sink_error(h) ((h)->sink_error)
+#define mexp_get_record_error(h) ((h)->record_error)
+extern void mexp_set_log_callback (mexp_h *h, mexp_log_callback cb, void *opaque);
+extern void mexp_set_log_rate_limit (mexp_h *h, unsigned per_second, unsigned burst);
+extern void mexp_get_stats (mexp_h *h, struct mexp_stats *stats);
+extern const struct mexp_histogram *mexp_get_histograms (mexp_h *h, size_t *nr);
+extern void mexp_reset_stats (mexp_h *h);
 
 /* Spawn a subprocess. */
 extern mexp_h *mexp_spawnvf (unsigned flags, const char *file, char **argv);
@@ -74,6 +146,21 @@ extern mexp_h *mexp_spawnlf (unsigned flags, const char *file, const char *arg,
 #define mexp_spawnv(file,argv) mexp_spawnvf (0, (file), (argv))
 #define mexp_spawnl(file,...) mexp_spawnlf (0, (file), __VA_ARGS__)
 
+/* Spawn server. */
+typedef struct mexp_server mexp_server;
+extern mexp_server *mexp_server_start (void);
+extern int mexp_server_stop (mexp_server *server);
+extern mexp_h *mexp_server_spawnvf (mexp_server *server, unsigned flags, const char *file, char **argv);
+#define mexp_server_spawnv(server,file,argv) mexp_server_spawnvf ((server), 0, (file), (argv))
+
+/* Pty pool and respawning. */
+typedef struct mexp_pty_pool mexp_pty_pool;
+extern mexp_pty_pool *mexp_pty_pool_create (size_t size);
+extern int mexp_pty_pool_fill (mexp_pty_pool *pool);
+extern void mexp_pty_pool_free (mexp_pty_pool *pool);
+extern mexp_h *mexp_pool_spawnvf (mexp_pty_pool *pool, unsigned flags, const char *file, char **argv);
+extern int mexp_respawnvf (mexp_h *h, mexp_pty_pool *pool, unsigned flags, const char *file, char **argv);
+
 #define MEXP_SPAWN_KEEP_SIGNALS 1
 #define MEXP_SPAWN_KEEP_FDS     2
 #define MEXP_SPAWN_COOKED_MODE  4
@@ -81,6 +168,8 @@ extern mexp_h *mexp_spawnlf (unsigned flags, const char *file, const char *arg,
 
 /* Close the handle. */
 extern int mexp_close (mexp_h *h);
+extern void mexp_set_handle_cache_size (size_t size);
+extern int mexp_wait (mexp_h *h);
 
 /* Expect. */
 struct mexp_regexp {
@@ -90,21 +179,73 @@ struct mexp_regexp {
 };
 typedef struct mexp_regexp mexp_regexp;
 
+#define MEXP_EXPECT_JIT 1
+#define MEXP_EXPECT_DFA 2
+#define MEXP_EXPECT_PREFILTER 4
+#define MEXP_EXPECT_LINES 8
+#define MEXP_EXPECT_DRAIN 16
+
 enum mexp_status {
   MEXP_EOF        = 0,
   MEXP_ERROR      = -1,
   MEXP_PCRE_ERROR = -2,
   MEXP_TIMEOUT    = -3,
+  MEXP_BUFFER_FULL = -4,
+  MEXP_AGAIN      = -5,
 };
 
 extern int mexp_expect (mexp_h *h, const mexp_regexp *regexps,
                         pcre2_match_data *match_data);
 
+/* Precompiled pattern sets. */
+typedef struct mexp_patterns mexp_patterns;
+extern mexp_patterns *mexp_patterns_create (void);
+extern void mexp_patterns_free (mexp_patterns *p);
+extern int mexp_patterns_add (mexp_patterns *p, int r, const char *pattern, uint32_t options, int *errorcode, PCRE2_SIZE *erroroffset);
+extern int mexp_patterns_add_literal (mexp_patterns *p, int r, const char *literal);
+extern int mexp_patterns_compile (mexp_patterns *p, unsigned flags);
+extern const mexp_regexp *mexp_patterns_regexps (const mexp_patterns *p);
+extern pcre2_match_data *mexp_patterns_match_data_create (const mexp_patterns *p);
+extern int mexp_expect_patterns (mexp_h *h, const mexp_patterns *p, pcre2_match_data *match_data);
+
+/* Non-blocking expect, for event loops. */
+extern int mexp_expect_start (mexp_h *h, const mexp_regexp *regexps, pcre2_match_data *match_data);
+extern int mexp_expect_step (mexp_h *h);
+extern int mexp_expect_timeout_ms (mexp_h *h);
+
+/* Waiting for many handles at once. */
+typedef struct mexp_set mexp_set;
+extern mexp_set *mexp_set_create (void);
+extern void mexp_set_free (mexp_set *set);
+extern int mexp_set_add (mexp_set *set, mexp_h *h, const mexp_regexp *regexps, pcre2_match_data *match_data);
+extern int mexp_set_remove (mexp_set *set, mexp_h *h);
+extern int mexp_set_wait (mexp_set *set, int timeout_ms, mexp_h **h, int *r);
+
+/* Running many sessions on a pool of threads. */
+typedef struct mexp_runner mexp_runner;
+typedef const mexp_regexp *(*mexp_session_fn) (mexp_h *h, int r, pcre2_match_data *match_data, void *opaque);
+extern mexp_runner *mexp_runner_create (unsigned nr_threads, uint32_t ovecsize);
+extern int mexp_runner_add (mexp_runner *runner, mexp_h *h, mexp_session_fn fn, void *opaque);
+extern void mexp_runner_wait (mexp_runner *runner);
+extern void mexp_runner_free (mexp_runner *runner);
+
+/* Recording and replaying sessions. */
+extern int mexp_start_recording (mexp_h *h, int fd);
+extern void mexp_stop_recording (mexp_h *h);
+extern mexp_h *mexp_replay_open (const char *filename, unsigned flags);
+
+#define MEXP_REPLAY_REALTIME 1
+#define MEXP_REPLAY_NO_MMAP  2
+
 /* Sending commands, keypresses. */
 extern int mexp_printf (mexp_h *h, const char *fs, ...)
   __attribute__((format(printf,2,3)));
 extern int mexp_printf_password (mexp_h *h, const char *fs, ...)
   __attribute__((format(printf,2,3)));
 extern int mexp_send_interrupt (mexp_h *h);
+extern ssize_t mexp_send (mexp_h *h, const void *buf, size_t len);
+extern ssize_t mexp_send_password (mexp_h *h, const void *buf, size_t len);
+extern ssize_t mexp_sendv (mexp_h *h, const struct iovec *iov, int iovcnt);
+extern int mexp_flush (mexp_h *h);
 
 #endif /* MINIEXPECT_H_ */
@@ -0,0 +1,77 @@
+/* miniexpect test suite
+ * Copyright (C) 2014-2022 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "miniexpect.h"
+#include "tests.h"
+
+int
+main (int argc __attribute__ ((unused)), char *argv[])
+{
+  mexp_h *h;
+  int status;
+  int r;
+  pcre2_code *end_re = test_compile_re ("4999\n5000\n");
+  pcre2_code *never_re = test_compile_re ("1\\d*x");
+  pcre2_match_data *match_data = pcre2_match_data_create (4, NULL);
+
+  /* Using MEXP_EXPECT_DFA the data is thrown away after each read,
+   * and matches which straddle reads are found by continuing the
+   * partial match.
+   */
+  h = mexp_spawnl ("seq", "seq", "1", "5000", NULL);
+  assert (h != NULL);
+  mexp_set_expect_flags (h, MEXP_EXPECT_DFA);
+  mexp_set_read_size (h, 7);
+
+  r = mexp_expect (h,
+                   (mexp_regexp[]) {
+                     { 100, .re = never_re },
+                     { 101, .re = end_re },
+                     { 0 },
+                   }, match_data);
+  if (r != 101) {
+    fprintf (stderr, "error: expected to match end of output, got %d\n", r);
+    exit (EXIT_FAILURE);
+  }
+  assert (h->len <= 7);
+  assert (h->alloc <= 7);
+
+  r = mexp_expect (h, NULL, NULL);
+  assert (r == MEXP_EOF);
+
+  status = mexp_close (h);
+  if (status != 0 && !test_is_sighup (status)) {
+    fprintf (stderr, "%s: non-zero exit status from subcommand: ", argv[0]);
+    test_diagnose (status);
+    fprintf (stderr, "\n");
+    exit (EXIT_FAILURE);
+  }
+
+  pcre2_code_free (end_re);
+  pcre2_code_free (never_re);
+  pcre2_match_data_free (match_data);
+
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,121 @@
+/* miniexpect test suite
+ * Copyright (C) 2014-2022 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test draining reads (MEXP_EXPECT_DRAIN). */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <assert.h>
+
+#include "miniexpect.h"
+#include "tests.h"
+
+/* About 14K of output, which all fits in the pty at once. */
+#define BURST "seq 1 3000; echo done"
+
+static void
+check_close (mexp_h *h, const char *prog)
+{
+  int status = mexp_close (h);
+
+  if (status != 0 && !test_is_sighup (status)) {
+    fprintf (stderr, "%s: non-zero exit status from subcommand: ", prog);
+    test_diagnose (status);
+    fprintf (stderr, "\n");
+    exit (EXIT_FAILURE);
+  }
+}
+
+/* Run the burst with the given flags, letting the output pile up in
+ * the pty before reading it.
+ */
+static void
+run_burst (const char *prog, unsigned flags, size_t drain_max,
+           const mexp_regexp *regexps, pcre2_match_data *match_data,
+           struct mexp_stats *stats)
+{
+  mexp_h *h;
+
+  h = mexp_spawnl ("sh", "sh", "-c", BURST, NULL);
+  assert (h != NULL);
+  mexp_set_expect_flags (h, flags);
+  if (drain_max > 0)
+    mexp_set_drain_max (h, drain_max);
+  usleep (500000);
+
+  assert (mexp_expect (h, regexps, match_data) == 100);
+  mexp_get_stats (h, stats);
+  assert (((fcntl (mexp_get_fd (h), F_GETFL) & O_NONBLOCK) != 0) ==
+          ((flags & MEXP_EXPECT_DRAIN) != 0));
+
+  check_close (h, prog);
+}
+
+int
+main (int argc __attribute__ ((unused)), char *argv[])
+{
+  mexp_h *h;
+  struct mexp_stats plain, drain, capped;
+  pcre2_code *done_re = test_compile_re ("(?m)^done$");
+  pcre2_code *world_re = test_compile_re ("world");
+  pcre2_match_data *match_data = pcre2_match_data_create (4, NULL);
+  const mexp_regexp done[] = {
+    { 100, .re = done_re },
+    { 0 },
+  };
+  const mexp_regexp world[] = {
+    { 101, .re = world_re },
+    { 0 },
+  };
+
+  /* Without draining there is a match pass after every 1K read.
+   * With it, everything waiting is read before one match pass.
+   */
+  run_burst (argv[0], 0, 0, done, match_data, &plain);
+  run_burst (argv[0], MEXP_EXPECT_DRAIN, 0, done, match_data, &drain);
+  assert (plain.bytes_read == drain.bytes_read);
+  assert (plain.matches >= 14);
+  assert (drain.matches <= 3);
+  assert (drain.reads < plain.reads);
+
+  /* The cap limits how much is read before each match pass. */
+  run_burst (argv[0], MEXP_EXPECT_DRAIN, 1024, done, match_data, &capped);
+  assert (capped.matches >= 14);
+
+  /* The end of the output is seen in the same drain as the data, but
+   * the data must still be matched first.
+   */
+  h = mexp_spawnl ("printf", "printf", "hello world", NULL);
+  assert (h != NULL);
+  mexp_set_expect_flags (h, MEXP_EXPECT_DRAIN);
+  usleep (200000);
+  assert (mexp_expect (h, world, match_data) == 101);
+  assert (mexp_expect (h, world, match_data) == MEXP_EOF);
+  check_close (h, argv[0]);
+
+  pcre2_code_free (done_re);
+  pcre2_code_free (world_re);
+  pcre2_match_data_free (match_data);
+
+  exit (EXIT_SUCCESS);
+}
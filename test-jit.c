@@ -0,0 +1,143 @@
+/* miniexpect test suite
+ * Copyright (C) 2014-2022 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "miniexpect.h"
+#include "tests.h"
+
+int
+main (int argc __attribute__ ((unused)), char *argv[])
+{
+  mexp_h *h;
+  mexp_patterns *p;
+  int status;
+  int r;
+  uint32_t jit;
+  pcre2_code *hello_re = test_compile_re ("hel+o");
+  pcre2_code *world_re = test_compile_re ("wor?ld");
+  pcre2_code *one_re = test_compile_re ("one");
+  pcre2_code *two_re = test_compile_re ("two");
+  pcre2_match_data *match_data = pcre2_match_data_create (4, NULL);
+
+  if (pcre2_config (PCRE2_CONFIG_JIT, &jit) != 0)
+    jit = 0;
+
+  h = mexp_spawnl ("echo", "echo", "hello world", NULL);
+  assert (h != NULL);
+  mexp_set_expect_flags (h, MEXP_EXPECT_JIT);
+  mexp_set_read_size (h, 3);
+
+  r = mexp_expect (h,
+                   (mexp_regexp[]) {
+                     { 100, .re = hello_re },
+                     { 0 },
+                   }, match_data);
+  assert (r == 100);
+  assert (mexp_get_jit_used (h) == !!jit);
+
+  /* Options which the JIT cannot handle fall back to the interpreter. */
+  r = mexp_expect (h,
+                   (mexp_regexp[]) {
+                     { 101, .re = world_re, .options = PCRE2_NO_JIT },
+                     { 0 },
+                   }, match_data);
+  assert (r == 101);
+  assert (mexp_get_jit_used (h) == 0);
+
+  status = mexp_close (h);
+  if (status != 0 && !test_is_sighup (status)) {
+    fprintf (stderr, "%s: non-zero exit status from subcommand: ", argv[0]);
+    test_diagnose (status);
+    fprintf (stderr, "\n");
+    exit (EXIT_FAILURE);
+  }
+
+  /* With two regexps, only one of which can use the JIT, the flag
+   * describes the one which matched, not the last one tried.
+   */
+  h = mexp_spawnl ("echo", "echo", "one two", NULL);
+  assert (h != NULL);
+  mexp_set_expect_flags (h, MEXP_EXPECT_JIT);
+  r = mexp_expect (h,
+                   (mexp_regexp[]) {
+                     { 100, .re = one_re },
+                     { 101, .re = two_re, .options = PCRE2_NO_JIT },
+                     { 0 },
+                   }, match_data);
+  assert (r == 100);
+  assert (mexp_get_jit_used (h) == !!jit);
+  r = mexp_expect (h,
+                   (mexp_regexp[]) {
+                     { 100, .re = two_re, .options = PCRE2_NO_JIT },
+                     { 101, .re = one_re },
+                     { 0 },
+                   }, match_data);
+  assert (r == 100);
+  assert (mexp_get_jit_used (h) == 0);
+  r = mexp_expect (h,
+                   (mexp_regexp[]) {
+                     { 100, .re = two_re },
+                     { 0 },
+                   }, match_data);
+  assert (r == MEXP_EOF);
+  assert (mexp_get_jit_used (h) == 0);
+
+  status = mexp_close (h);
+  if (status != 0 && !test_is_sighup (status)) {
+    fprintf (stderr, "%s: non-zero exit status from subcommand: ", argv[0]);
+    test_diagnose (status);
+    fprintf (stderr, "\n");
+    exit (EXIT_FAILURE);
+  }
+
+  /* A literal string never uses the JIT, even if a JIT-compiled
+   * regexp was tried before it.
+   */
+  p = mexp_patterns_create ();
+  assert (p != NULL);
+  assert (mexp_patterns_add (p, 100, "two", 0, NULL, NULL) == 0);
+  assert (mexp_patterns_add_literal (p, 101, "one") == 0);
+  assert (mexp_patterns_compile (p, MEXP_EXPECT_JIT) == 0);
+  h = mexp_spawnl ("echo", "echo", "one", NULL);
+  assert (h != NULL);
+  assert (mexp_expect_patterns (h, p, match_data) == 101);
+  assert (mexp_get_jit_used (h) == 0);
+
+  status = mexp_close (h);
+  if (status != 0 && !test_is_sighup (status)) {
+    fprintf (stderr, "%s: non-zero exit status from subcommand: ", argv[0]);
+    test_diagnose (status);
+    fprintf (stderr, "\n");
+    exit (EXIT_FAILURE);
+  }
+  mexp_patterns_free (p);
+
+  pcre2_code_free (hello_re);
+  pcre2_code_free (world_re);
+  pcre2_code_free (one_re);
+  pcre2_code_free (two_re);
+  pcre2_match_data_free (match_data);
+
+  exit (EXIT_SUCCESS);
+}
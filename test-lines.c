@@ -0,0 +1,189 @@
+/* miniexpect test suite
+ * Copyright (C) 2014-2022 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test line-oriented matching (MEXP_EXPECT_LINES). */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "miniexpect.h"
+#include "tests.h"
+
+static void
+check_close (mexp_h *h, const char *prog)
+{
+  int status = mexp_close (h);
+
+  if (status != 0 && !test_is_sighup (status)) {
+    fprintf (stderr, "%s: non-zero exit status from subcommand: ", prog);
+    test_diagnose (status);
+    fprintf (stderr, "\n");
+    exit (EXIT_FAILURE);
+  }
+}
+
+int
+main (int argc __attribute__ ((unused)), char *argv[])
+{
+  mexp_h *h;
+  mexp_patterns *p;
+  struct mexp_stats stats;
+  const PCRE2_SIZE *ovector;
+  pcre2_code *line99_re = test_compile_re ("^9(9)$");
+  pcre2_code *line50000_re = test_compile_re ("^50000$");
+  pcre2_code *abc_re = test_compile_re ("^abc$");
+  pcre2_code *abcdef_re = test_compile_re ("^abcdef$");
+  pcre2_code *foo_re = test_compile_re ("foo");
+  pcre2_code *start_foo_re = test_compile_re ("^foo");
+  pcre2_code *dollar_re = test_compile_re ("\\$ $");
+  pcre2_code *prompt_re = test_compile_re ("prompt> ");
+  pcre2_match_data *match_data = pcre2_match_data_create (4, NULL);
+  const mexp_regexp line99[] = {
+    { 100, .re = line99_re },
+    { 0 },
+  };
+  const mexp_regexp line50000_or_prompt[] = {
+    { 101, .re = line50000_re },
+    { 102, .re = prompt_re },
+    { 0 },
+  };
+  const mexp_regexp prompt[] = {
+    { 102, .re = prompt_re },
+    { 0 },
+  };
+  const mexp_regexp abc[] = {
+    { 103, .re = abc_re },
+    { 104, .re = abcdef_re },
+    { 102, .re = prompt_re },
+    { 0 },
+  };
+  const mexp_regexp foo[] = {
+    { 107, .re = start_foo_re },
+    { 108, .re = foo_re },
+    { 0 },
+  };
+  const mexp_regexp dollar[] = {
+    { 109, .re = dollar_re },
+    { 0 },
+  };
+
+  /* Lots of output, matched a line at a time.  In cooked mode the
+   * pty turns \n into \r\n, which must not stop $ from matching.
+   * "199" and "990" must not match.
+   */
+  h = mexp_spawnlf (MEXP_SPAWN_COOKED_MODE, "sh", "sh", "-c",
+                    "seq 1 100000; printf 'prompt> '", NULL);
+  assert (h != NULL);
+  mexp_set_expect_flags (h, MEXP_EXPECT_LINES);
+
+  assert (mexp_expect (h, line99, match_data) == 100);
+  ovector = pcre2_get_ovector_pointer (match_data);
+  assert (ovector[0] == 0);
+  assert (ovector[1] == 2);
+  assert (ovector[2] == 1);
+  assert (strncmp (h->buffer, "99\r\n", 4) == 0);
+  assert (mexp_expect (h, line50000_or_prompt, match_data) == 101);
+  assert (strncmp (h->buffer, "50000", 5) == 0);
+  assert (mexp_expect (h, prompt, match_data) == 102);
+
+  /* Lines which didn't match were thrown away as they arrived. */
+  mexp_get_stats (h, &stats);
+  assert (stats.bytes_read > 500000);
+  assert (stats.buffer_high_water <= 2 * mexp_get_read_size (h) + 16);
+
+  assert (mexp_expect (h, prompt, match_data) == MEXP_EOF);
+  check_close (h, argv[0]);
+
+  /* A partial line is matched like the end of the buffer in the
+   * normal mode, so "^abc$" matches before "def" arrives.  Matching
+   * then continues in the same line, where ^ doesn't match.
+   */
+  h = mexp_spawnl ("sh", "sh", "-c",
+                   "printf abc; sleep 0.3; printf 'def\\n'; printf 'prompt> '",
+                   NULL);
+  assert (h != NULL);
+  mexp_set_expect_flags (h, MEXP_EXPECT_LINES);
+  assert (mexp_expect (h, abc, match_data) == 103);
+  assert (mexp_expect (h, abc, match_data) == 102);
+  assert (mexp_expect (h, abc, match_data) == MEXP_EOF);
+  check_close (h, argv[0]);
+
+  /* The rest of a completed line can match again after a match. */
+  h = mexp_spawnl ("printf", "printf", "foo foo\\nfoo\\n", NULL);
+  assert (h != NULL);
+  mexp_set_expect_flags (h, MEXP_EXPECT_LINES);
+  assert (mexp_expect (h, foo, match_data) == 107);
+  assert (mexp_expect (h, foo, match_data) == 108);
+  assert (mexp_expect (h, foo, match_data) == 107);
+  assert (mexp_expect (h, foo, match_data) == MEXP_EOF);
+  check_close (h, argv[0]);
+
+  /* A prompt pattern may end with $. */
+  h = mexp_spawnl ("printf", "printf", "user$ ", NULL);
+  assert (h != NULL);
+  mexp_set_expect_flags (h, MEXP_EXPECT_LINES);
+  assert (mexp_expect (h, dollar, match_data) == 109);
+  assert (mexp_expect (h, dollar, match_data) == MEXP_EOF);
+  check_close (h, argv[0]);
+
+  /* max_buffer_size still bounds a long line, by dropping the start
+   * of it which can't match.
+   */
+  h = mexp_spawnl ("sh", "sh", "-c",
+                   "head -c 100000 /dev/zero | tr '\\0' a; printf 'prompt> '",
+                   NULL);
+  assert (h != NULL);
+  mexp_set_expect_flags (h, MEXP_EXPECT_LINES);
+  mexp_set_max_buffer_size (h, 4096);
+  assert (mexp_expect (h, line50000_or_prompt, match_data) == 102);
+  assert (h->len <= 4096);
+  assert (mexp_expect (h, prompt, match_data) == MEXP_EOF);
+  check_close (h, argv[0]);
+
+  /* Precompiled patterns in line mode. */
+  p = mexp_patterns_create ();
+  assert (p != NULL);
+  assert (mexp_patterns_add (p, 105, "^b$", 0, NULL, NULL) == 0);
+  assert (mexp_patterns_add_literal (p, 106, "c") == 0);
+  assert (mexp_patterns_compile (p,
+                                 MEXP_EXPECT_LINES|MEXP_EXPECT_JIT) == 0);
+  h = mexp_spawnl ("printf", "printf", "ab\\nb\\nc\\n", NULL);
+  assert (h != NULL);
+  assert (mexp_expect_patterns (h, p, NULL) == 105);
+  assert (mexp_expect_patterns (h, p, NULL) == 106);
+  assert (mexp_expect_patterns (h, p, NULL) == MEXP_EOF);
+  check_close (h, argv[0]);
+  mexp_patterns_free (p);
+
+  pcre2_code_free (line99_re);
+  pcre2_code_free (line50000_re);
+  pcre2_code_free (abc_re);
+  pcre2_code_free (abcdef_re);
+  pcre2_code_free (foo_re);
+  pcre2_code_free (start_foo_re);
+  pcre2_code_free (dollar_re);
+  pcre2_code_free (prompt_re);
+  pcre2_match_data_free (match_data);
+
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,126 @@
+/* miniexpect test suite
+ * Copyright (C) 2014-2022 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "miniexpect.h"
+#include "tests.h"
+
+static void
+check_close (mexp_h *h, const char *prog)
+{
+  int status = mexp_close (h);
+
+  if (status != 0 && !test_is_sighup (status)) {
+    fprintf (stderr, "%s: non-zero exit status from subcommand: ", prog);
+    test_diagnose (status);
+    fprintf (stderr, "\n");
+    exit (EXIT_FAILURE);
+  }
+}
+
+int
+main (int argc __attribute__ ((unused)), char *argv[])
+{
+  mexp_h *h;
+  mexp_patterns *p;
+  int r;
+  size_t i, j;
+  const unsigned flags[] = { 0, MEXP_EXPECT_DFA, MEXP_EXPECT_PREFILTER };
+  const int expected[] = { 100, 101, 102, 103, 104, MEXP_EOF };
+  pcre2_match_data *match_data = pcre2_match_data_create (4, NULL);
+
+  /* Same as test-multi-match, but using literal strings, and reading
+   * a single byte at a time so that every literal is split across
+   * reads.  The "aab" literal checks that the partial match is
+   * restarted correctly (the output contains "aaab").
+   */
+  for (j = 0; j < sizeof flags / sizeof flags[0]; ++j) {
+    p = mexp_patterns_create ();
+    assert (p != NULL);
+    assert (mexp_patterns_add_literal (p, 100, "multi") == 0);
+    assert (mexp_patterns_add_literal (p, 101, "aab") == 0);
+    assert (mexp_patterns_add_literal (p, 102, "match") == 0);
+    assert (mexp_patterns_add_literal (p, 103, "ingstr") == 0);
+    assert (mexp_patterns_add_literal (p, 104, "s\n") == 0);
+    assert (mexp_patterns_compile (p, flags[j]) == 0);
+
+    h = mexp_spawnl ("echo", "echo", "multiaaabmatchingstrs", NULL);
+    assert (h != NULL);
+    mexp_set_read_size (h, 1);
+
+    for (i = 0; i < sizeof expected / sizeof expected[0]; ++i) {
+      r = mexp_expect_patterns (h, p, NULL);
+      if (r != expected[i]) {
+        fprintf (stderr, "error: flags %u, iteration %zu: "
+                 "expected %d but got %d\n", flags[j], i, expected[i], r);
+        exit (EXIT_FAILURE);
+      }
+    }
+    check_close (h, argv[0]);
+
+    /* The same literals work as regexps with mexp_expect.  (Except in
+     * DFA mode, where a partial match restarted by pcre2_dfa_match
+     * can't find the overlapping "aab".)
+     */
+    if (flags[j] & MEXP_EXPECT_DFA) {
+      mexp_patterns_free (p);
+      continue;
+    }
+    h = mexp_spawnl ("echo", "echo", "multiaaabmatchingstrs", NULL);
+    assert (h != NULL);
+    mexp_set_expect_flags (h, flags[j]);
+    mexp_set_read_size (h, 1);
+    for (i = 0; i < sizeof expected / sizeof expected[0]; ++i)
+      assert (mexp_expect (h, mexp_patterns_regexps (p), match_data)
+              == expected[i]);
+    check_close (h, argv[0]);
+
+    mexp_patterns_free (p);
+  }
+
+  /* An empty literal is an error. */
+  p = mexp_patterns_create ();
+  assert (p != NULL);
+  errno = 0;
+  assert (mexp_patterns_add_literal (p, 100, "") == -1);
+  assert (errno == EINVAL);
+  mexp_patterns_free (p);
+
+  /* An entry without a regexp is an error. */
+  h = mexp_spawnl ("echo", "echo", "hello", NULL);
+  assert (h != NULL);
+  errno = 0;
+  r = mexp_expect (h,
+                   (mexp_regexp[]) {
+                     { 100, NULL, 0 },
+                     { 0 },
+                   }, NULL);
+  assert (r == MEXP_ERROR);
+  assert (errno == EINVAL);
+  check_close (h, argv[0]);
+
+  pcre2_match_data_free (match_data);
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,174 @@
+/* miniexpect test suite
+ * Copyright (C) 2014-2022 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test the log callback, its rate limit and the debug file. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "miniexpect.h"
+#include "tests.h"
+
+struct log {
+  int events[5];                /* count of each type */
+  int delivered;
+  uint64_t dropped;
+  int last_type, last_r;
+  char data[16384];             /* everything read, without \r */
+  size_t len;
+  int password_seen;
+};
+
+static void
+log_cb (mexp_h *h __attribute__ ((unused)),
+        const struct mexp_log_event *event, void *opaque)
+{
+  struct log *log = opaque;
+  size_t i;
+
+  assert (event->type >= MEXP_LOG_POLL && event->type <= MEXP_LOG_SEND);
+  log->events[event->type]++;
+  log->delivered++;
+  log->dropped += event->dropped;
+  log->last_type = event->type;
+  log->last_r = event->r;
+
+  switch (event->type) {
+  case MEXP_LOG_READ:
+    /* Only the new bytes are passed. */
+    assert (event->r > 0 ? event->len == (size_t) event->r : event->len == 0);
+    for (i = 0; i < event->len; ++i)
+      if (event->data[i] != '\r') {
+        assert (log->len < sizeof log->data);
+        log->data[log->len++] = event->data[i];
+      }
+    break;
+  case MEXP_LOG_SEND:
+    if (event->r) {
+      /* Password data is never passed. */
+      assert (event->data == NULL);
+      log->password_seen = 1;
+    }
+    else
+      assert (event->data != NULL);
+    break;
+  }
+}
+
+static void
+check_status (int status, const char *prog)
+{
+  if (status != 0 && !test_is_sighup (status)) {
+    fprintf (stderr, "%s: non-zero exit status from subcommand: ", prog);
+    test_diagnose (status);
+    fprintf (stderr, "\n");
+    exit (EXIT_FAILURE);
+  }
+}
+
+int
+main (int argc __attribute__ ((unused)), char *argv[])
+{
+  mexp_h *h;
+  int r, i;
+  struct log log;
+  FILE *debug;
+  char *p, *expected, line[16];
+  size_t len;
+  long size;
+
+  memset (&log, 0, sizeof log);
+  debug = tmpfile ();
+  assert (debug != NULL);
+
+  h = mexp_spawnl ("seq", "seq", "1", "2000", NULL);
+  assert (h != NULL);
+  mexp_set_read_size (h, 100);
+  mexp_set_log_callback (h, log_cb, &log);
+  mexp_set_debug_file (h, debug);
+  assert (mexp_printf (h, "hello\n") == 6);
+  assert (mexp_printf_password (h, "secret\n") == 7);
+  r = mexp_expect (h, (mexp_regexp[]) { { 0 } }, NULL);
+  assert (r == MEXP_EOF);
+  check_status (mexp_close (h), argv[0]);
+
+  assert (log.events[MEXP_LOG_POLL] > 0);
+  assert (log.events[MEXP_LOG_READ] > 10);
+  assert (log.events[MEXP_LOG_RESULT] == 1);
+  assert (log.events[MEXP_LOG_SEND] == 2);
+  assert (log.password_seen);
+  assert (log.last_type == MEXP_LOG_RESULT);
+  assert (log.last_r == MEXP_EOF);
+  assert (log.dropped == 0);
+
+  /* The read events together have all the output. */
+  expected = malloc (sizeof log.data);
+  assert (expected != NULL);
+  len = 0;
+  for (i = 1; i <= 2000; ++i) {
+    snprintf (line, sizeof line, "%d\n", i);
+    memcpy (expected + len, line, strlen (line));
+    len += strlen (line);
+  }
+  assert (log.len == len);
+  assert (memcmp (log.data, expected, len) == 0);
+  free (expected);
+
+  /* The debug file has each chunk once, escaped, and not the
+   * password.  Before, the whole buffer was printed after each read.
+   */
+  size = ftell (debug);
+  assert (size > 0 && size < 4 * (long) len);
+  p = malloc (size + 1);
+  assert (p != NULL);
+  rewind (debug);
+  assert (fread (p, 1, size, debug) == (size_t) size);
+  p[size] = '\0';
+  assert (strstr (p, "hello\\n") != NULL);
+  assert (strstr (p, "secret") == NULL);
+  assert (strstr (p, "1999") != NULL);
+  free (p);
+  fclose (debug);
+
+  /* With a rate limit of 1 event a second in bursts of up to 3, the
+   * events after the first 3 are dropped, and the next event to be
+   * delivered says how many.
+   */
+  memset (&log, 0, sizeof log);
+  h = mexp_spawnl ("seq", "seq", "1", "2000", NULL);
+  assert (h != NULL);
+  mexp_set_read_size (h, 100);
+  mexp_set_log_callback (h, log_cb, &log);
+  mexp_set_log_rate_limit (h, 1, 3);
+  r = mexp_expect (h, (mexp_regexp[]) { { 0 } }, NULL);
+  assert (r == MEXP_EOF);
+  assert (log.delivered <= 4);
+  assert (log.dropped == 0);
+  sleep (1);
+  assert (mexp_printf (h, "hello\n") == 6);
+  assert (log.last_type == MEXP_LOG_SEND);
+  assert (log.dropped > 10);
+  check_status (mexp_close (h), argv[0]);
+
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,105 @@
+/* miniexpect test suite
+ * Copyright (C) 2014-2022 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "miniexpect.h"
+#include "tests.h"
+
+int
+main (int argc __attribute__ ((unused)), char *argv[])
+{
+  mexp_h *h;
+  int status;
+  int r;
+  pcre2_code *lookbehind_re = test_compile_re ("(?<=19999\\n)20000");
+  pcre2_code *pair_re = test_compile_re ("\\b199(\\d)7\\n199\\g{1}8\\n");
+  pcre2_code *open_re = test_compile_re ("^1\\n(\\d+\\n)*x");
+  pcre2_code *tail_re = test_compile_re ("\\d+\\n\\d+\\nx");
+  pcre2_match_data *match_data = pcre2_match_data_create (4, NULL);
+
+  /* "pair_re" keeps a partial match open for a few bytes at a time,
+   * and "lookbehind_re" needs the data before the match start, so the
+   * buffer must be trimmed carefully for these to match.  "tail_re"
+   * always partially matches the last two lines, so the buffer is
+   * never simply cleared.
+   */
+  h = mexp_spawnl ("seq", "seq", "1", "20000", NULL);
+  assert (h != NULL);
+  mexp_set_read_size (h, 16);
+  mexp_set_max_buffer_size (h, 64);
+
+  r = mexp_expect (h,
+                   (mexp_regexp[]) {
+                     { 100, .re = pair_re },
+                     { 0 },
+                   }, match_data);
+  assert (r == 100);
+  assert (h->len <= 64);
+
+  r = mexp_expect (h,
+                   (mexp_regexp[]) {
+                     { 101, .re = lookbehind_re },
+                     { 102, .re = tail_re },
+                     { 0 },
+                   }, match_data);
+  assert (r == 101);
+  assert (h->len <= 64);
+
+  status = mexp_close (h);
+  if (status != 0 && !test_is_sighup (status)) {
+    fprintf (stderr, "%s: non-zero exit status from subcommand: ", argv[0]);
+    test_diagnose (status);
+    fprintf (stderr, "\n");
+    exit (EXIT_FAILURE);
+  }
+
+  /* A partial match which never finishes must hit the limit. */
+  h = mexp_spawnl ("seq", "seq", "1", "20000", NULL);
+  assert (h != NULL);
+  mexp_set_max_buffer_size (h, 4096);
+
+  r = mexp_expect (h,
+                   (mexp_regexp[]) {
+                     { 100, .re = open_re },
+                     { 0 },
+                   }, match_data);
+  assert (r == MEXP_BUFFER_FULL);
+  assert (h->len == 4096);
+
+  status = mexp_close (h);
+  if (status != 0 && !test_is_sighup (status)) {
+    fprintf (stderr, "%s: non-zero exit status from subcommand: ", argv[0]);
+    test_diagnose (status);
+    fprintf (stderr, "\n");
+    exit (EXIT_FAILURE);
+  }
+
+  pcre2_code_free (lookbehind_re);
+  pcre2_code_free (pair_re);
+  pcre2_code_free (open_re);
+  pcre2_code_free (tail_re);
+  pcre2_match_data_free (match_data);
+
+  exit (EXIT_SUCCESS);
+}
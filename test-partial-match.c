@@ -0,0 +1,97 @@
+/* miniexpect test suite
+ * Copyright (C) 2014-2022 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "miniexpect.h"
+#include "tests.h"
+
+int
+main (int argc __attribute__ ((unused)), char *argv[])
+{
+  mexp_h *h;
+  int status;
+  int r;
+  PCRE2_UCHAR *str;
+  PCRE2_SIZE len;
+  pcre2_code *aaab_re = test_compile_re ("a{3}b");
+  pcre2_code *open_re = test_compile_re ("_m.*q");
+  pcre2_code *xyz_re = test_compile_re ("xyz");
+  pcre2_match_data *match_data = pcre2_match_data_create (4, NULL);
+
+  /* Read one byte at a time so that partial matches are kept open
+   * across many reads.  mexp_expect only rescans from the point
+   * where each regexp could still start to match, and this checks
+   * that doing so doesn't lose any matches.
+   */
+  h = mexp_spawnl ("echo", "echo", "aaaaaaaaab_multiple_matches_xyz", NULL);
+  assert (h != NULL);
+  mexp_set_read_size (h, 1);
+
+  r = mexp_expect (h,
+                   (mexp_regexp[]) {
+                     { 100, .re = aaab_re },
+                     { 101, .re = open_re },
+                     { 102, .re = xyz_re },
+                     { 0 },
+                   }, match_data);
+  if (r != 100) {
+    fprintf (stderr, "error: expected to match 'a{3}b', got %d\n", r);
+    exit (EXIT_FAILURE);
+  }
+  r = pcre2_substring_get_bynumber (match_data, 0, &str, &len);
+  assert (r == 0);
+  assert (strcmp ((char *) str, "aaab") == 0);
+  pcre2_substring_free (str);
+
+  /* "_m.*q" stays partially matched until EOF, but must not stop
+   * "xyz" from matching.
+   */
+  r = mexp_expect (h,
+                   (mexp_regexp[]) {
+                     { 100, .re = aaab_re },
+                     { 101, .re = open_re },
+                     { 102, .re = xyz_re },
+                     { 0 },
+                   }, match_data);
+  if (r != 102) {
+    fprintf (stderr, "error: expected to match 'xyz', got %d\n", r);
+    exit (EXIT_FAILURE);
+  }
+
+  status = mexp_close (h);
+  if (status != 0 && !test_is_sighup (status)) {
+    fprintf (stderr, "%s: non-zero exit status from subcommand: ", argv[0]);
+    test_diagnose (status);
+    fprintf (stderr, "\n");
+    exit (EXIT_FAILURE);
+  }
+
+  pcre2_code_free (aaab_re);
+  pcre2_code_free (open_re);
+  pcre2_code_free (xyz_re);
+  pcre2_match_data_free (match_data);
+
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,152 @@
+/* miniexpect test suite
+ * Copyright (C) 2014-2022 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test precompiled pattern sets shared between handles. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "miniexpect.h"
+#include "tests.h"
+
+static void
+check_close (mexp_h *h, const char *prog)
+{
+  int status = mexp_close (h);
+
+  if (status != 0 && !test_is_sighup (status)) {
+    fprintf (stderr, "%s: non-zero exit status from subcommand: ", prog);
+    test_diagnose (status);
+    fprintf (stderr, "\n");
+    exit (EXIT_FAILURE);
+  }
+}
+
+int
+main (int argc __attribute__ ((unused)), char *argv[])
+{
+  mexp_h *h1, *h2;
+  mexp_patterns *p;
+  int errorcode;
+  PCRE2_SIZE erroroffset;
+  pcre2_match_data *match_data;
+  const PCRE2_SIZE *ovector;
+  int r;
+
+  p = mexp_patterns_create ();
+  assert (p != NULL);
+  assert (mexp_patterns_add (p, 100, "hello", 0, NULL, NULL) == 0);
+  assert (mexp_patterns_add (p, 101, "id=([0-9]+)", 0, NULL, NULL) == 0);
+  assert (mexp_patterns_add_literal (p, 102, "$ ") == 0);
+  assert (mexp_patterns_add (p, 103, "^start", 0, NULL, NULL) == 0);
+
+  /* A bad pattern fails with EINVAL and returns the PCRE2 error. */
+  errno = 0;
+  r = mexp_patterns_add (p, 104, "(unclosed", 0, &errorcode, &erroroffset);
+  assert (r == -1);
+  assert (errno == EINVAL);
+  assert (errorcode == PCRE2_ERROR_MISSING_CLOSING_PARENTHESIS);
+  assert (erroroffset == 9);
+
+  /* Can't use the patterns before they are compiled. */
+  h1 = mexp_spawnl ("sh", "sh", "-c", "echo hello", NULL);
+  assert (h1 != NULL);
+  errno = 0;
+  assert (mexp_expect_patterns (h1, p, NULL) == MEXP_ERROR);
+  assert (errno == EINVAL);
+  check_close (h1, argv[0]);
+
+  assert (mexp_patterns_compile (p,
+                                 MEXP_EXPECT_JIT|MEXP_EXPECT_PREFILTER) == 0);
+  assert (mexp_patterns_regexps (p)[4].r == 0);
+
+  /* The set is read-only once compiled. */
+  errno = 0;
+  assert (mexp_patterns_add (p, 105, "late", 0, NULL, NULL) == -1);
+  assert (errno == EBUSY);
+  errno = 0;
+  assert (mexp_patterns_compile (p, 0) == -1);
+  assert (errno == EBUSY);
+
+  /* Two handles using the same patterns at the same time. */
+  h1 = mexp_spawnl ("sh", "sh", "-c",
+                    "echo hello; sleep 0.1; echo id=42; printf '$ '",
+                    NULL);
+  assert (h1 != NULL);
+  h2 = mexp_spawnl ("sh", "sh", "-c",
+                    "echo start; sleep 0.1; echo id=7; printf '$ '",
+                    NULL);
+  assert (h2 != NULL);
+
+  /* The handle supplies the match data. */
+  assert (mexp_expect_patterns (h1, p, NULL) == 100);
+  assert (mexp_expect_patterns (h2, p, NULL) == 103);
+
+  /* Captures need the caller's match data. */
+  match_data = mexp_patterns_match_data_create (p);
+  assert (match_data != NULL);
+  assert (pcre2_get_ovector_count (match_data) >= 2);
+  assert (mexp_expect_patterns (h1, p, match_data) == 101);
+  ovector = pcre2_get_ovector_pointer (match_data);
+  assert (ovector[3] - ovector[2] == 2);
+  assert (memcmp (&h1->buffer[ovector[2]], "42", 2) == 0);
+  assert (mexp_expect_patterns (h2, p, match_data) == 101);
+  ovector = pcre2_get_ovector_pointer (match_data);
+  assert (memcmp (&h2->buffer[ovector[2]], "7", 1) == 0);
+
+  assert (mexp_expect_patterns (h1, p, match_data) == 102);
+  assert (mexp_expect_patterns (h2, p, NULL) == 102);
+  assert (mexp_expect_patterns (h1, p, match_data) == MEXP_EOF);
+  assert (mexp_expect_patterns (h2, p, match_data) == MEXP_EOF);
+
+  /* The compiled regexps also work with the ordinary functions. */
+  assert (mexp_expect (h1, mexp_patterns_regexps (p), match_data) == MEXP_EOF);
+
+  check_close (h1, argv[0]);
+  check_close (h2, argv[0]);
+  pcre2_match_data_free (match_data);
+  mexp_patterns_free (p);
+
+  /* Matching continues in the data left after the previous match.
+   * ^ in an alternation must still match at the start of it.
+   */
+  p = mexp_patterns_create ();
+  assert (p != NULL);
+  assert (mexp_patterns_add (p, 1, "x|^b", 0, NULL, NULL) == 0);
+  assert (mexp_patterns_add (p, 2, "foo", 0, NULL, NULL) == 0);
+  assert (mexp_patterns_add_literal (p, 3, "done") == 0);
+  assert (mexp_patterns_compile (p, 0) == 0);
+  h1 = mexp_spawnl ("printf", "printf", "foobfoo foo done", NULL);
+  assert (h1 != NULL);
+  assert (mexp_expect_patterns (h1, p, NULL) == 2);
+  assert (mexp_expect_patterns (h1, p, NULL) == 1);
+  assert (mexp_expect_patterns (h1, p, NULL) == 2);
+  assert (mexp_expect_patterns (h1, p, NULL) == 2);
+  assert (mexp_expect_patterns (h1, p, NULL) == 3);
+  assert (mexp_expect_patterns (h1, p, NULL) == MEXP_EOF);
+  check_close (h1, argv[0]);
+  mexp_patterns_free (p);
+
+  exit (EXIT_SUCCESS);
+}
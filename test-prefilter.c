@@ -0,0 +1,148 @@
+/* miniexpect test suite
+ * Copyright (C) 2014-2022 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "miniexpect.h"
+#include "tests.h"
+
+#define NR_ERRORS 50
+
+static void
+check_close (mexp_h *h, const char *prog)
+{
+  int status = mexp_close (h);
+
+  if (status != 0 && !test_is_sighup (status)) {
+    fprintf (stderr, "%s: non-zero exit status from subcommand: ", prog);
+    test_diagnose (status);
+    fprintf (stderr, "\n");
+    exit (EXIT_FAILURE);
+  }
+}
+
+static void
+run (const char *prog, unsigned flags, const mexp_regexp *regexps,
+     const mexp_patterns *p, pcre2_match_data *match_data)
+{
+  const int expected[] = { 201, 142, 200, 202, MEXP_EOF };
+  mexp_h *h;
+  size_t i;
+  int r;
+
+  h = mexp_spawnl ("echo", "echo",
+                   "xx warning: disk\nerror4 error42: boom\nPrompt$ bye",
+                   NULL);
+  assert (h != NULL);
+  mexp_set_expect_flags (h, flags);
+  mexp_set_read_size (h, 3);
+
+  for (i = 0; i < sizeof expected / sizeof expected[0]; ++i) {
+    if (p)
+      r = mexp_expect_patterns (h, p, match_data);
+    else
+      r = mexp_expect (h, regexps, match_data);
+    if (r != expected[i]) {
+      fprintf (stderr, "error: flags %u, %s, iteration %zu: "
+               "expected %d but got %d\n", flags, p ? "patterns" : "list",
+               i, expected[i], r);
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  check_close (h, prog);
+}
+
+int
+main (int argc __attribute__ ((unused)), char *argv[])
+{
+  mexp_h *h;
+  mexp_patterns *p;
+  size_t i, j;
+  char rex[64];
+  char *big;
+  mexp_regexp regexps[NR_ERRORS + 4];
+  const unsigned flags[] = { 0, MEXP_EXPECT_PREFILTER };
+  pcre2_match_data *match_data = pcre2_match_data_create (4, NULL);
+
+  /* Lots of regexps with a first code unit, one with none, and one
+   * literal string.  The prefilter must give the same results as
+   * matching every regexp in order.
+   */
+  for (j = 0; j < sizeof flags / sizeof flags[0]; ++j) {
+    p = mexp_patterns_create ();
+    assert (p != NULL);
+    for (i = 0; i < NR_ERRORS; ++i) {
+      snprintf (rex, sizeof rex, "error%zu: \\w+\\n", i);
+      assert (mexp_patterns_add (p, 100 + i, rex, 0, NULL, NULL) == 0);
+    }
+    assert (mexp_patterns_add (p, 200, "(?i)prompt\\$ ", 0,
+                               NULL, NULL) == 0);
+    assert (mexp_patterns_add (p, 201, "[wx]arning", 0, NULL, NULL) == 0);
+    assert (mexp_patterns_add_literal (p, 202, "bye") == 0);
+    assert (mexp_patterns_compile (p, flags[j]) == 0);
+
+    run (argv[0], 0, NULL, p, match_data);
+    /* The same list as ordinary regexps, with the handle's flags. */
+    run (argv[0], flags[j], mexp_patterns_regexps (p), NULL, match_data);
+
+    mexp_patterns_free (p);
+  }
+
+  /* The prefilter cached in the handle must not be reused when a
+   * list at the same address has changed.
+   */
+  h = mexp_spawnl ("echo", "echo", "first second", NULL);
+  assert (h != NULL);
+  mexp_set_expect_flags (h, MEXP_EXPECT_PREFILTER);
+  regexps[0] = (mexp_regexp) { 100, test_compile_re ("first"), 0 };
+  regexps[1] = (mexp_regexp) { 0 };
+  assert (mexp_expect (h, regexps, match_data) == 100);
+  pcre2_code_free ((pcre2_code *) regexps[0].re);
+  regexps[0].re = test_compile_re ("second");
+  assert (mexp_expect (h, regexps, match_data) == 100);
+  pcre2_code_free ((pcre2_code *) regexps[0].re);
+  check_close (h, argv[0]);
+
+  /* Literals too long for the automaton just turn the prefilter off. */
+  big = malloc (10000);
+  assert (big != NULL);
+  memset (big, 'x', 9999);
+  big[9999] = '\0';
+  p = mexp_patterns_create ();
+  assert (p != NULL);
+  assert (mexp_patterns_add_literal (p, 100, big) == 0);
+  assert (mexp_patterns_add_literal (p, 101, "\n") == 0);
+  assert (mexp_patterns_compile (p, MEXP_EXPECT_PREFILTER) == 0);
+  h = mexp_spawnl ("echo", "echo", "first second", NULL);
+  assert (h != NULL);
+  assert (mexp_expect_patterns (h, p, NULL) == 101);
+  check_close (h, argv[0]);
+  mexp_patterns_free (p);
+
+  free (big);
+  pcre2_match_data_free (match_data);
+
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,185 @@
+/* miniexpect test suite
+ * Copyright (C) 2014-2022 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test recording a session, then replaying it both at full speed and
+ * with the original timing.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <assert.h>
+
+#include "miniexpect.h"
+#include "tests.h"
+
+static int64_t
+elapsed_ms (const struct timespec *start)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec - start->tv_sec) * 1000 +
+    (ts.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/* Replay the recording, checking we see the same output. */
+static void
+replay (const char *filename, unsigned flags,
+        const mexp_regexp *regexps, pcre2_match_data *match_data)
+{
+  mexp_h *h;
+  int r;
+
+  h = mexp_replay_open (filename, flags);
+  assert (h != NULL);
+  assert (mexp_get_pid (h) == 0);
+  mexp_set_read_size (h, 7);
+
+  r = mexp_expect (h, regexps, match_data);
+  assert (r == 100);
+  /* Sending to a replay is allowed, but does nothing. */
+  assert (mexp_printf (h, "hello\n") == 6);
+  r = mexp_expect (h, regexps, match_data);
+  assert (r == 101);
+  r = mexp_expect (h, regexps, match_data);
+  assert (r == MEXP_EOF);
+
+  assert (mexp_close (h) == 0);
+}
+
+int
+main (int argc __attribute__ ((unused)), char *argv[])
+{
+  mexp_h *h;
+  int status, r;
+  int fds[2];
+  FILE *rec, *bad;
+  char filename[64], bad_filename[64];
+  struct timespec start;
+  pcre2_code *one_re = test_compile_re ("(?m)^one$");
+  pcre2_code *two_re = test_compile_re ("(?m)^two$");
+  pcre2_match_data *match_data = pcre2_match_data_create (4, NULL);
+  const mexp_regexp regexps[] = {
+    { 100, .re = one_re },
+    { 101, .re = two_re },
+    { 0 },
+  };
+
+  rec = tmpfile ();
+  assert (rec != NULL);
+  snprintf (filename, sizeof filename, "/dev/fd/%d", fileno (rec));
+
+  /* Record a session with a pause in the middle.  The child waits
+   * for input so that the pause can't start before "one" is recorded.
+   */
+  h = mexp_spawnl ("sh", "sh", "-c",
+                   "echo one; read x; sleep 0.3; echo two", NULL);
+  assert (h != NULL);
+  assert (mexp_start_recording (h, fileno (rec)) == 0);
+  r = mexp_expect (h, regexps, match_data);
+  assert (r == 100);
+  assert (mexp_printf (h, "go\n") == 3);
+  r = mexp_expect (h, regexps, match_data);
+  assert (r == 101);
+  r = mexp_expect (h, regexps, match_data);
+  assert (r == MEXP_EOF);
+  mexp_stop_recording (h);
+
+  status = mexp_close (h);
+  if (status != 0 && !test_is_sighup (status)) {
+    fprintf (stderr, "%s: non-zero exit status from subcommand: ", argv[0]);
+    test_diagnose (status);
+    fprintf (stderr, "\n");
+    exit (EXIT_FAILURE);
+  }
+
+  /* At full speed the pause disappears. */
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  replay (filename, 0, regexps, match_data);
+  assert (elapsed_ms (&start) < 250);
+  replay (filename, MEXP_REPLAY_NO_MMAP, regexps, match_data);
+
+  /* In realtime the pause is kept, and timeouts work as usual. */
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  h = mexp_replay_open (filename, MEXP_REPLAY_REALTIME);
+  assert (h != NULL);
+  r = mexp_expect (h, regexps, match_data);
+  assert (r == 100);
+  mexp_set_timeout_ms (h, 50);
+  r = mexp_expect (h, regexps, match_data);
+  assert (r == MEXP_TIMEOUT);
+  mexp_set_timeout_ms (h, 5000);
+  r = mexp_expect (h, regexps, match_data);
+  assert (r == 101);
+  assert (elapsed_ms (&start) >= 250);
+  r = mexp_expect (h, regexps, match_data);
+  assert (r == MEXP_EOF);
+  assert (mexp_close (h) == 0);
+
+  /* A replay has no fd, so the non-blocking API can't be used. */
+  h = mexp_replay_open (filename, 0);
+  assert (h != NULL);
+  assert (mexp_expect_start (h, regexps, match_data) == MEXP_ERROR);
+  assert (errno == EINVAL);
+  mexp_close (h);
+  fclose (rec);
+
+  /* If writing the recording fails, recording stops but matching
+   * carries on.
+   */
+  assert (pipe (fds) == 0);
+  h = mexp_spawnl ("sh", "sh", "-c", "echo one", NULL);
+  assert (h != NULL);
+  assert (mexp_start_recording (h, fds[1]) == 0);
+  close (fds[0]);
+  r = mexp_expect (h, regexps, match_data);
+  assert (r == 100);
+  assert (mexp_get_record_error (h) == EPIPE);
+  r = mexp_expect (h, regexps, match_data);
+  assert (r == MEXP_EOF);
+  status = mexp_close (h);
+  if (status != 0 && !test_is_sighup (status)) {
+    fprintf (stderr, "%s: non-zero exit status from subcommand: ", argv[0]);
+    test_diagnose (status);
+    fprintf (stderr, "\n");
+    exit (EXIT_FAILURE);
+  }
+  close (fds[1]);
+
+  /* Something which isn't a recording. */
+  bad = tmpfile ();
+  assert (bad != NULL);
+  fputs ("not a recording\n", bad);
+  fflush (bad);
+  snprintf (bad_filename, sizeof bad_filename, "/dev/fd/%d", fileno (bad));
+  assert (mexp_replay_open (bad_filename, 0) == NULL);
+  assert (errno == EINVAL);
+  fclose (bad);
+
+  pcre2_code_free (one_re);
+  pcre2_code_free (two_re);
+  pcre2_match_data_free (match_data);
+
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,105 @@
+/* miniexpect test suite
+ * Copyright (C) 2014-2022 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test the pty pool and reusing a handle with mexp_respawnvf. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/wait.h>
+
+#include "miniexpect.h"
+#include "tests.h"
+
+int
+main (int argc __attribute__ ((unused)), char *argv[])
+{
+  mexp_pty_pool *pool;
+  mexp_h *h;
+  int i, r, status;
+  char cmd[64];
+  char *sh_argv[] = { "sh", "-c", cmd, NULL };
+  char *cat_argv[] = { "cat", NULL };
+  pcre2_code *run_re = test_compile_re ("run ");
+  pcre2_code *hello_re = test_compile_re ("hello");
+  pcre2_match_data *match_data = pcre2_match_data_create (4, NULL);
+
+  pool = mexp_pty_pool_create (4);
+  assert (pool != NULL);
+
+  snprintf (cmd, sizeof cmd, "echo run 0; exit 0");
+  h = mexp_pool_spawnvf (pool, 0, "sh", sh_argv);
+  assert (h != NULL);
+  mexp_set_timeout (h, 10);
+  mexp_set_read_size (h, 16);
+
+  /* Run more children than there are ptys in the pool, so that some
+   * of them have to open a new pty.
+   */
+  for (i = 0; i < 10; ++i) {
+    r = mexp_expect (h,
+                     (mexp_regexp[]) {
+                       { 100, run_re, 0 },
+                       { 0 },
+                     }, match_data);
+    assert (r == 100);
+    assert (h->buffer[h->next_match] == '0' + i);
+    r = mexp_expect (h, (mexp_regexp[]) { { 0 } }, NULL);
+    assert (r == MEXP_EOF);
+    status = mexp_wait (h);
+    assert (WIFEXITED (status) && WEXITSTATUS (status) == i);
+    assert (mexp_wait (h) == -1);
+
+    /* The settings are kept. */
+    assert (mexp_get_timeout_ms (h) == 10000);
+    assert (mexp_get_read_size (h) == 16);
+
+    snprintf (cmd, sizeof cmd, "echo run %d; exit %d", i+1, i+1);
+    assert (mexp_respawnvf (h, pool, 0, "sh", sh_argv) == 0);
+  }
+
+  /* Respawning while the child is still running closes it first. */
+  assert (mexp_respawnvf (h, pool, 0, "cat", cat_argv) == 0);
+  assert (mexp_respawnvf (h, pool, 0, "cat", cat_argv) == 0);
+  assert (mexp_printf (h, "hello\n") == 6);
+  r = mexp_expect (h,
+                   (mexp_regexp[]) {
+                     { 100, hello_re, 0 },
+                     { 0 },
+                   }, match_data);
+  assert (r == 100);
+
+  status = mexp_close (h);
+  if (status != 0 && !test_is_sighup (status)) {
+    fprintf (stderr, "%s: non-zero exit status from subcommand: ", argv[0]);
+    test_diagnose (status);
+    fprintf (stderr, "\n");
+    exit (EXIT_FAILURE);
+  }
+
+  assert (mexp_pty_pool_fill (pool) == 0);
+  mexp_pty_pool_free (pool);
+  pcre2_code_free (run_re);
+  pcre2_code_free (hello_re);
+  pcre2_match_data_free (match_data);
+
+  exit (EXIT_SUCCESS);
+}
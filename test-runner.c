@@ -0,0 +1,143 @@
+/* miniexpect test suite
+ * Copyright (C) 2014-2022 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test running many dialogs on a pool of threads with mexp_runner. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <assert.h>
+
+#include "miniexpect.h"
+#include "tests.h"
+
+#define NR_SESSIONS 200
+#define NR_THREADS 4
+
+static pcre2_code *got_re, *bye_re;
+static mexp_regexp got_regexps[2], bye_regexps[2];
+
+struct session {
+  int n;
+  int state;
+  int status;
+  pthread_t thread;             /* where the session finished */
+};
+
+/* Log in, run a command, and collect the output. */
+static const mexp_regexp *
+dialog (mexp_h *h, int r, pcre2_match_data *match_data, void *opaque)
+{
+  struct session *s = opaque;
+  char num[16];
+  size_t len;
+
+  switch (s->state++) {
+  case 0:
+    assert (r == MEXP_AGAIN);
+    assert (mexp_printf (h, "hello %d\n", s->n) > 0);
+    return got_regexps;
+
+  case 1:
+    assert (r == 100);
+    assert (mexp_printf (h, "%d\n", s->n * 2) > 0);
+    return bye_regexps;
+
+  case 2:
+    assert (r == 101);
+    len = sizeof num;
+    pcre2_substring_copy_bynumber (match_data, 1, (PCRE2_UCHAR *) num, &len);
+    assert (atoi (num) == s->n * 2);
+    s->status = mexp_close (h);
+    s->thread = pthread_self ();
+    return NULL;
+
+  default:
+    abort ();
+  }
+}
+
+int
+main (int argc __attribute__ ((unused)), char *argv[])
+{
+  mexp_runner *runner;
+  mexp_h *h;
+  struct session *sessions;
+  pthread_t threads[NR_THREADS];
+  int i, j, nr_threads = 0;
+
+  got_re = test_compile_re ("got hello");
+  bye_re = test_compile_re ("bye (\\d+)");
+  got_regexps[0] = (mexp_regexp) { 100, .re = got_re };
+  bye_regexps[0] = (mexp_regexp) { 101, .re = bye_re };
+
+  sessions = calloc (NR_SESSIONS, sizeof *sessions);
+  assert (sessions != NULL);
+
+  runner = mexp_runner_create (NR_THREADS, 4);
+  assert (runner != NULL);
+
+  for (i = 0; i < NR_SESSIONS; ++i) {
+    h = mexp_spawnl ("sh", "sh", "-c",
+                     "read x; echo got $x; read y; echo bye $y", NULL);
+    assert (h != NULL);
+    sessions[i].n = i;
+    assert (mexp_runner_add (runner, h, dialog, &sessions[i]) == 0);
+  }
+
+  mexp_runner_wait (runner);
+
+  for (i = 0; i < NR_SESSIONS; ++i) {
+    assert (sessions[i].state == 3);
+    if (sessions[i].status != 0 && !test_is_sighup (sessions[i].status)) {
+      fprintf (stderr, "%s: non-zero exit status from subcommand: ",
+               argv[0]);
+      test_diagnose (sessions[i].status);
+      fprintf (stderr, "\n");
+      exit (EXIT_FAILURE);
+    }
+    /* Count the threads which ran sessions. */
+    for (j = 0; j < nr_threads; ++j)
+      if (pthread_equal (threads[j], sessions[i].thread))
+        break;
+    if (j == nr_threads) {
+      assert (nr_threads < NR_THREADS);
+      threads[nr_threads++] = sessions[i].thread;
+    }
+  }
+  assert (nr_threads > 1);
+
+  /* The runner can be reused after waiting. */
+  h = mexp_spawnl ("sh", "sh", "-c",
+                   "read x; echo got $x; read y; echo bye $y", NULL);
+  assert (h != NULL);
+  memset (&sessions[0], 0, sizeof sessions[0]);
+  assert (mexp_runner_add (runner, h, dialog, &sessions[0]) == 0);
+  mexp_runner_free (runner);
+  assert (sessions[0].state == 3);
+
+  free (sessions);
+  pcre2_code_free (got_re);
+  pcre2_code_free (bye_re);
+
+  exit (EXIT_SUCCESS);
+}
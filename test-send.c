@@ -0,0 +1,167 @@
+/* miniexpect test suite
+ * Copyright (C) 2014-2022 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test mexp_send, mexp_sendv and the outgoing queue. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <assert.h>
+#include <sys/uio.h>
+
+#include "miniexpect.h"
+#include "tests.h"
+
+#define BIG 100000
+
+static long
+elapsed_ms (const struct timespec *start)
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000 +
+    (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static void
+close_handle (mexp_h *h, const char *prog)
+{
+  int status;
+
+  status = mexp_close (h);
+  if (status != 0 && !test_is_sighup (status)) {
+    fprintf (stderr, "%s: non-zero exit status from subcommand: ", prog);
+    test_diagnose (status);
+    fprintf (stderr, "\n");
+    exit (EXIT_FAILURE);
+  }
+}
+
+int
+main (int argc __attribute__ ((unused)), char *argv[])
+{
+  mexp_h *h;
+  mexp_set *set;
+  mexp_h *rh;
+  int r;
+  char *debug;
+  size_t debug_len;
+  FILE *fp;
+  char *big;
+  struct timespec start;
+  struct iovec iov[3] = {
+    { .iov_base = "wor", .iov_len = 3 },
+    { .iov_base = "", .iov_len = 0 },
+    { .iov_base = "ld\n", .iov_len = 3 },
+  };
+  pcre2_code *done_re = test_compile_re ("done");
+  pcre2_code *all_re = test_compile_re ("hello\nworld\nsecret\nsecret2\n");
+  pcre2_match_data *match_data = pcre2_match_data_create (4, NULL);
+  const mexp_regexp done_regexps[] = {
+    { 100, done_re, 0 },
+    { 0 },
+  };
+
+  /* Blocking sends. */
+  h = mexp_spawnl ("cat", "cat", NULL);
+  assert (h != NULL);
+  fp = open_memstream (&debug, &debug_len);
+  assert (fp != NULL);
+  mexp_set_debug_file (h, fp);
+
+  assert (mexp_send (h, "hello\n", 6) == 6);
+  assert (mexp_sendv (h, iov, 3) == 6);
+  assert (mexp_send_password (h, "secret\n", 7) == 7);
+  assert (mexp_printf_password (h, "%s\n", "secret2") == 8);
+  r = mexp_expect (h,
+                   (mexp_regexp[]) {
+                     { 100, all_re, 0 },
+                     { 0 },
+                   }, match_data);
+  assert (r == 100);
+  assert (mexp_flush (h) == 0);
+  mexp_set_debug_file (h, NULL);
+  fclose (fp);
+  assert (strstr (debug, "hello") != NULL);
+  assert (strstr (debug, "world") != NULL);
+  assert (strstr (debug, "writing the password") != NULL);
+  /* The buffer contents are debugged too, so look only at the writes. */
+  assert (strstr (debug, "DEBUG: writing: secret") == NULL);
+  free (debug);
+  close_handle (h, argv[0]);
+
+  big = malloc (BIG);
+  assert (big != NULL);
+  memset (big, 'x', BIG);
+
+  /* On a non-blocking pty, sending doesn't wait for a slow reader.
+   * mexp_expect carries on sending the queued data.
+   */
+  h = mexp_spawnl ("sh", "sh", "-c",
+                   "sleep 0.5; head -c 100000 >/dev/null; echo done", NULL);
+  assert (h != NULL);
+  r = mexp_expect_start (h, done_regexps, match_data);
+  assert (r == MEXP_AGAIN);
+  assert (mexp_send (h, big, BIG) == BIG);
+  assert (mexp_flush (h) > 0);
+  r = mexp_expect (h, done_regexps, match_data);
+  assert (r == 100);
+  assert (mexp_flush (h) == 0);
+  close_handle (h, argv[0]);
+
+  /* mexp_close waits for the queue to be read before closing the
+   * pty, rather than dropping it.
+   */
+  h = mexp_spawnl ("sh", "sh", "-c",
+                   "sleep 0.5; head -c 100000 >/dev/null", NULL);
+  assert (h != NULL);
+  r = mexp_expect_start (h, done_regexps, match_data);
+  assert (r == MEXP_AGAIN);
+  assert (mexp_send (h, big, BIG) == BIG);
+  assert (mexp_flush (h) > 0);
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  close_handle (h, argv[0]);
+  assert (elapsed_ms (&start) >= 400);
+
+  /* The same with mexp_set. */
+  set = mexp_set_create ();
+  assert (set != NULL);
+  h = mexp_spawnl ("sh", "sh", "-c",
+                   "sleep 0.5; head -c 100000 >/dev/null; echo done", NULL);
+  assert (h != NULL);
+  assert (mexp_set_add (set, h, done_regexps, match_data) == 0);
+  assert (mexp_send (h, big, BIG) == BIG);
+  assert (mexp_flush (h) > 0);
+  assert (mexp_set_wait (set, 10000, &rh, &r) == 1);
+  assert (rh == h);
+  assert (r == 100);
+  assert (mexp_flush (h) == 0);
+  close_handle (h, argv[0]);
+  mexp_set_free (set);
+
+  free (big);
+  pcre2_code_free (done_re);
+  pcre2_code_free (all_re);
+  pcre2_match_data_free (match_data);
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,97 @@
+/* miniexpect test suite
+ * Copyright (C) 2014-2022 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test spawning subprocesses through the spawn server. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/wait.h>
+
+#include "miniexpect.h"
+#include "tests.h"
+
+int
+main (int argc __attribute__ ((unused)), char *argv[])
+{
+  mexp_server *server;
+  mexp_h *h, *h2;
+  int r, status;
+  char *sh_argv[] = { "sh", "-c", "echo hello; exit 3", NULL };
+  char *cat_argv[] = { "cat", NULL };
+  char *nonexistent_argv[] = { "/nonexistent", NULL };
+  pcre2_code *hello_re = test_compile_re ("hello");
+  pcre2_code *world_re = test_compile_re ("world");
+  pcre2_match_data *match_data = pcre2_match_data_create (4, NULL);
+
+  server = mexp_server_start ();
+  assert (server != NULL);
+
+  /* Two subprocesses at the same time, closed in the opposite order. */
+  h = mexp_server_spawnv (server, "sh", sh_argv);
+  assert (h != NULL);
+  h2 = mexp_server_spawnv (server, "cat", cat_argv);
+  assert (h2 != NULL);
+  assert (h->pid != h2->pid);
+
+  r = mexp_expect (h,
+                   (mexp_regexp[]) {
+                     { 100, hello_re, 0 },
+                     { 0 },
+                   }, match_data);
+  assert (r == 100);
+
+  /* cat must have the pty as its terminal. */
+  assert (mexp_printf (h2, "world\n") == 6);
+  r = mexp_expect (h2,
+                   (mexp_regexp[]) {
+                     { 100, world_re, 0 },
+                     { 0 },
+                   }, match_data);
+  assert (r == 100);
+
+  status = mexp_close (h2);
+  if (status != 0 && !test_is_sighup (status)) {
+    fprintf (stderr, "%s: non-zero exit status from subcommand: ", argv[0]);
+    test_diagnose (status);
+    fprintf (stderr, "\n");
+    exit (EXIT_FAILURE);
+  }
+
+  /* The exit status comes back through the server. */
+  status = mexp_close (h);
+  assert (WIFEXITED (status) && WEXITSTATUS (status) == 3);
+
+  /* A program which doesn't exist. */
+  h = mexp_server_spawnv (server, "/nonexistent", nonexistent_argv);
+  assert (h != NULL);
+  r = mexp_expect (h, (mexp_regexp[]) { { 0 } }, NULL);
+  assert (r == MEXP_EOF);
+  status = mexp_close (h);
+  assert (WIFEXITED (status) && WEXITSTATUS (status) == EXIT_FAILURE);
+
+  assert (mexp_server_stop (server) == 0);
+
+  pcre2_code_free (hello_re);
+  pcre2_code_free (world_re);
+  pcre2_match_data_free (match_data);
+  exit (EXIT_SUCCESS);
+}
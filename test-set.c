@@ -0,0 +1,159 @@
+/* miniexpect test suite
+ * Copyright (C) 2014-2022 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test waiting for many handles at once with mexp_set. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "miniexpect.h"
+#include "tests.h"
+
+#define NR_HANDLES 20
+
+int
+main (int argc __attribute__ ((unused)), char *argv[])
+{
+  mexp_set *set;
+  mexp_h *h[NR_HANDLES], *sleeper, *chatty[8], *rh;
+  int matched[NR_HANDLES] = { 0 }, eof[NR_HANDLES] = { 0 };
+  int i, r, ret, status, done;
+  char cmd[64];
+  pcre2_code *hello_re = test_compile_re ("hello (\\d+)");
+  pcre2_match_data *match_data[NR_HANDLES+1];
+  const mexp_regexp hello_regexps[] = {
+    { 100, .re = hello_re },
+    { 0 },
+  };
+  const mexp_regexp eof_regexps[] = { { 0 } };
+
+  /* Several handles can complete in one call, so each needs its own
+   * match data.
+   */
+  for (i = 0; i <= NR_HANDLES; ++i)
+    match_data[i] = pcre2_match_data_create (4, NULL);
+
+  set = mexp_set_create ();
+  assert (set != NULL);
+
+  /* Nothing to wait for. */
+  ret = mexp_set_wait (set, 0, &rh, &r);
+  assert (ret == 0);
+
+  for (i = 0; i < NR_HANDLES; ++i) {
+    snprintf (cmd, sizeof cmd, "sleep 0.%d; echo hello %d", i % 5, i);
+    h[i] = mexp_spawnl ("sh", "sh", "-c", cmd, NULL);
+    assert (h[i] != NULL);
+    assert (mexp_set_add (set, h[i], hello_regexps, match_data[i]) == 0);
+    assert (mexp_set_add (set, h[i], hello_regexps, match_data[i]) == -1);
+  }
+
+  /* This one has its own short timeout. */
+  sleeper = mexp_spawnl ("sleep", "sleep", "10", NULL);
+  assert (sleeper != NULL);
+  mexp_set_timeout_ms (sleeper, 100);
+  assert (mexp_set_add (set, sleeper, hello_regexps,
+                        match_data[NR_HANDLES]) == 0);
+
+  /* Each handle first matches, then is rearmed to wait for EOF. */
+  done = 0;
+  while (done < 2 * NR_HANDLES + 1) {
+    ret = mexp_set_wait (set, 10000, &rh, &r);
+    assert (ret == 1);
+    done++;
+
+    if (rh == sleeper) {
+      assert (r == MEXP_TIMEOUT);
+      continue;
+    }
+
+    for (i = 0; i < NR_HANDLES; ++i)
+      if (rh == h[i])
+        break;
+    assert (i < NR_HANDLES);
+
+    if (!matched[i]) {
+      size_t len;
+      char num[16];
+
+      assert (r == 100);
+      len = sizeof num;
+      pcre2_substring_copy_bynumber (match_data[i], 1,
+                                     (PCRE2_UCHAR *) num, &len);
+      assert (atoi (num) == i);
+      matched[i] = 1;
+      assert (mexp_set_add (set, rh, eof_regexps, NULL) == 0);
+    }
+    else {
+      assert (r == MEXP_EOF);
+      assert (!eof[i]);
+      eof[i] = 1;
+    }
+  }
+
+  /* Everything is disarmed now. */
+  ret = mexp_set_wait (set, 50, &rh, &r);
+  assert (ret == 0);
+
+  for (i = 0; i < NR_HANDLES; ++i) {
+    assert (matched[i] && eof[i]);
+    status = mexp_close (h[i]);
+    if (status != 0 && !test_is_sighup (status)) {
+      fprintf (stderr, "%s: non-zero exit status from subcommand: ",
+               argv[0]);
+      test_diagnose (status);
+      fprintf (stderr, "\n");
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  /* Closing a handle removes it from the set. */
+  status = mexp_close (sleeper);
+  assert (test_is_sighup (status));
+  assert (mexp_set_remove (set, h[0]) == -1);
+
+  /* The timeout of mexp_set_wait expires even while handles keep
+   * producing output which never matches.  Reading a byte at a time
+   * from several handles means there is always more to read.
+   */
+  for (i = 0; i < 8; ++i) {
+    chatty[i] = mexp_spawnl ("yes", "yes", NULL);
+    assert (chatty[i] != NULL);
+    mexp_set_timeout_ms (chatty[i], -1);
+    mexp_set_read_size (chatty[i], 1);
+    assert (mexp_set_add (set, chatty[i], hello_regexps,
+                          match_data[i]) == 0);
+  }
+  alarm (10);
+  ret = mexp_set_wait (set, 200, &rh, &r);
+  alarm (0);
+  assert (ret == 0);
+  for (i = 0; i < 8; ++i)
+    mexp_close (chatty[i]);
+
+  mexp_set_free (set);
+  pcre2_code_free (hello_re);
+  for (i = 0; i <= NR_HANDLES; ++i)
+    pcre2_match_data_free (match_data[i]);
+
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,142 @@
+/* miniexpect test suite
+ * Copyright (C) 2014-2022 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test that the output sink gets everything, even the data which
+ * the matcher throws away.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <assert.h>
+
+#include "miniexpect.h"
+#include "tests.h"
+
+int
+main (int argc __attribute__ ((unused)), char *argv[])
+{
+  mexp_h *h;
+  int status, r, i;
+  int fds[2];
+  FILE *sink;
+  char line[64];
+  pcre2_code *re = test_compile_re ("(?m)^5000$");
+  pcre2_code *last_re = test_compile_re ("(?m)^100000$");
+  pcre2_match_data *match_data = pcre2_match_data_create (4, NULL);
+
+  sink = tmpfile ();
+  assert (sink != NULL);
+
+  h = mexp_spawnl ("seq", "seq", "1", "10000", NULL);
+  assert (h != NULL);
+  assert (mexp_get_sink_fd (h) == -1);
+  mexp_set_sink_fd (h, fileno (sink));
+  /* Small reads, so the buffer is cleared many times. */
+  mexp_set_read_size (h, 7);
+
+  r = mexp_expect (h,
+                   (mexp_regexp[]) {
+                     { 100, .re = re },
+                     { 0 },
+                   }, match_data);
+  assert (r == 100);
+  r = mexp_expect (h, (mexp_regexp[]) { { 0 } }, NULL);
+  assert (r == MEXP_EOF);
+
+  status = mexp_close (h);
+  if (status != 0 && !test_is_sighup (status)) {
+    fprintf (stderr, "%s: non-zero exit status from subcommand: ", argv[0]);
+    test_diagnose (status);
+    fprintf (stderr, "\n");
+    exit (EXIT_FAILURE);
+  }
+
+  rewind (sink);
+  for (i = 1; i <= 10000; ++i) {
+    assert (fgets (line, sizeof line, sink) != NULL);
+    assert (atoi (line) == i);
+    assert (strchr (line, '\n') != NULL);
+  }
+  assert (fgets (line, sizeof line, sink) == NULL);
+  fclose (sink);
+
+  /* A sink which fails (here a pipe with no reader, which would raise
+   * SIGPIPE) is turned off, and matching carries on.
+   */
+  assert (pipe (fds) == 0);
+  close (fds[0]);
+  h = mexp_spawnl ("seq", "seq", "1", "10000", NULL);
+  assert (h != NULL);
+  mexp_set_sink_fd (h, fds[1]);
+  r = mexp_expect (h,
+                   (mexp_regexp[]) {
+                     { 100, .re = re },
+                     { 0 },
+                   }, match_data);
+  assert (r == 100);
+  assert (mexp_get_sink_fd (h) == -1);
+  assert (mexp_get_sink_error (h) == EPIPE);
+  mexp_set_sink_fd (h, -1);
+  assert (mexp_get_sink_error (h) == 0);
+  status = mexp_close (h);
+  if (status != 0 && !test_is_sighup (status)) {
+    fprintf (stderr, "%s: non-zero exit status from subcommand: ", argv[0]);
+    test_diagnose (status);
+    fprintf (stderr, "\n");
+    exit (EXIT_FAILURE);
+  }
+  close (fds[1]);
+
+  /* Nothing is queued for a non-blocking sink, so once a pipe which
+   * is never read is full, the sink is turned off.
+   */
+  assert (pipe (fds) == 0);
+  assert (fcntl (fds[1], F_SETFL, O_NONBLOCK) == 0);
+  h = mexp_spawnl ("seq", "seq", "1", "100000", NULL);
+  assert (h != NULL);
+  mexp_set_sink_fd (h, fds[1]);
+  r = mexp_expect (h,
+                   (mexp_regexp[]) {
+                     { 100, .re = last_re },
+                     { 0 },
+                   }, match_data);
+  assert (r == 100);
+  assert (mexp_get_sink_fd (h) == -1);
+  assert (mexp_get_sink_error (h) == EAGAIN);
+  status = mexp_close (h);
+  if (status != 0 && !test_is_sighup (status)) {
+    fprintf (stderr, "%s: non-zero exit status from subcommand: ", argv[0]);
+    test_diagnose (status);
+    fprintf (stderr, "\n");
+    exit (EXIT_FAILURE);
+  }
+  close (fds[0]);
+  close (fds[1]);
+
+  pcre2_code_free (re);
+  pcre2_code_free (last_re);
+  pcre2_match_data_free (match_data);
+
+  exit (EXIT_SUCCESS);
+}
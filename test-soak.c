@@ -0,0 +1,233 @@
+/* miniexpect test suite
+ * Copyright (C) 2014-2022 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Soak test: drive many simultaneous sessions for several rounds,
+ * respawning the handles between rounds, and check that no file
+ * descriptors or child processes are leaked.  The scale can be set
+ * with $MEXP_SOAK_SESSIONS and $MEXP_SOAK_ROUNDS, eg:
+ *
+ *   MEXP_SOAK_SESSIONS=2000 MEXP_SOAK_ROUNDS=10 ./test-soak
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <assert.h>
+
+#include "miniexpect.h"
+#include "tests.h"
+
+static char *session_argv[] = {
+  "sh", "-c", "read x; echo got $x", NULL
+};
+
+static long
+getenv_long (const char *name, long def)
+{
+  const char *s = getenv (name);
+
+  return s && atol (s) > 0 ? atol (s) : def;
+}
+
+static int64_t
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Count our open file descriptors, or -1 if we can't. */
+static int
+count_fds (void)
+{
+  DIR *dir;
+  struct dirent *d;
+  int n = 0;
+
+  dir = opendir ("/proc/self/fd");
+  if (dir == NULL)
+    return -1;
+  while ((d = readdir (dir)) != NULL)
+    if (d->d_name[0] != '.')
+      n++;
+  closedir (dir);
+  return n;
+}
+
+static int
+compare_int64 (const void *a, const void *b)
+{
+  int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+static double
+percentile_ms (const int64_t *sorted, size_t n, double p)
+{
+  return sorted[(size_t) (p * (n - 1))] / 1e6;
+}
+
+int
+main (int argc __attribute__ ((unused)), char *argv[])
+{
+  long nr_sessions = getenv_long ("MEXP_SOAK_SESSIONS", 50);
+  long nr_rounds = getenv_long ("MEXP_SOAK_ROUNDS", 3);
+  mexp_h **h, *rh;
+  mexp_set *set;
+  int64_t *sent, *latency;
+  size_t nr_latency = 0;
+  pcre2_match_data **match_data;
+  long i, round, done;
+  int r, ret, status, fds_before, fds, max_fds = 0;
+  struct rlimit rl;
+  struct rusage ru;
+  pcre2_code *got_re = test_compile_re ("got hello");
+  const mexp_regexp got_regexps[] = {
+    { 100, .re = got_re },
+    { 0 },
+  };
+  const mexp_regexp eof_regexps[] = { { 0 } };
+
+  /* Each session needs an fd for its pty, so allow as many as we can. */
+  if (getrlimit (RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit (RLIMIT_NOFILE, &rl);
+  }
+
+  h = calloc (nr_sessions, sizeof *h);
+  sent = calloc (nr_sessions, sizeof *sent);
+  latency = calloc (nr_sessions * nr_rounds, sizeof *latency);
+  match_data = calloc (nr_sessions, sizeof *match_data);
+  assert (h && sent && latency && match_data);
+  for (i = 0; i < nr_sessions; ++i) {
+    match_data[i] = pcre2_match_data_create (4, NULL);
+    assert (match_data[i] != NULL);
+  }
+
+  fds_before = count_fds ();
+  set = mexp_set_create ();
+  assert (set != NULL);
+
+  for (round = 0; round < nr_rounds; ++round) {
+    /* Start all the sessions.  After the first round, the handles
+     * are reused, which has to reap the previous subprocesses.
+     */
+    for (i = 0; i < nr_sessions; ++i) {
+      if (round == 0) {
+        h[i] = mexp_spawnv ("sh", session_argv);
+        if (h[i] == NULL) {
+          fprintf (stderr, "%s: spawning session %ld: %m\n", argv[0], i);
+          exit (EXIT_FAILURE);
+        }
+        h[i]->user1 = (void *) (intptr_t) i;
+      }
+      else if (mexp_respawnvf (h[i], NULL, 0, "sh", session_argv) == -1) {
+        fprintf (stderr, "%s: respawning session %ld: %m\n", argv[0], i);
+        exit (EXIT_FAILURE);
+      }
+      mexp_set_timeout_ms (h[i], 30000);
+    }
+
+    fds = count_fds ();
+    if (fds > max_fds)
+      max_fds = fds;
+
+    for (i = 0; i < nr_sessions; ++i) {
+      assert (mexp_set_add (set, h[i], got_regexps, match_data[i]) == 0);
+      sent[i] = now_ns ();
+      assert (mexp_printf (h[i], "hello\n") == 6);
+    }
+
+    /* Each session first replies, then is rearmed to wait for EOF. */
+    done = 0;
+    while (done < 2 * nr_sessions) {
+      ret = mexp_set_wait (set, 60000, &rh, &r);
+      assert (ret == 1);
+      done++;
+      i = (intptr_t) rh->user1;
+
+      if (r == 100) {
+        latency[nr_latency++] = now_ns () - sent[i];
+        assert (mexp_set_add (set, rh, eof_regexps, NULL) == 0);
+      }
+      else if (r != MEXP_EOF) {
+        fprintf (stderr, "%s: session %ld: unexpected result %d\n",
+                 argv[0], i, r);
+        exit (EXIT_FAILURE);
+      }
+    }
+  }
+
+  for (i = 0; i < nr_sessions; ++i) {
+    status = mexp_close (h[i]);
+    if (status != 0 && !test_is_sighup (status)) {
+      fprintf (stderr, "%s: non-zero exit status from subcommand: ",
+               argv[0]);
+      test_diagnose (status);
+      fprintf (stderr, "\n");
+      exit (EXIT_FAILURE);
+    }
+  }
+  mexp_set_free (set);
+
+  /* Every subprocess must have been reaped ... */
+  if (waitpid (-1, &status, WNOHANG) != -1 || errno != ECHILD) {
+    fprintf (stderr, "%s: unreaped child processes\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  /* ... and every fd closed. */
+  fds = count_fds ();
+  if (fds != fds_before) {
+    fprintf (stderr, "%s: leaked %d file descriptors\n",
+             argv[0], fds - fds_before);
+    exit (EXIT_FAILURE);
+  }
+
+  assert (nr_latency == (size_t) (nr_sessions * nr_rounds));
+  qsort (latency, nr_latency, sizeof *latency, compare_int64);
+  getrusage (RUSAGE_SELF, &ru);
+  printf ("%ld sessions x %ld rounds\n", nr_sessions, nr_rounds);
+  printf ("latency ms: p50 %.3f  p90 %.3f  p99 %.3f  max %.3f\n",
+          percentile_ms (latency, nr_latency, 0.5),
+          percentile_ms (latency, nr_latency, 0.9),
+          percentile_ms (latency, nr_latency, 0.99),
+          percentile_ms (latency, nr_latency, 1.0));
+  printf ("high water: %d fds, %ld KB rss\n", max_fds, ru.ru_maxrss);
+
+  for (i = 0; i < nr_sessions; ++i)
+    pcre2_match_data_free (match_data[i]);
+  free (match_data);
+  free (latency);
+  free (sent);
+  free (h);
+  pcre2_code_free (got_re);
+
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,115 @@
+/* miniexpect test suite
+ * Copyright (C) 2014-2022 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test that the subprocess gets a controlling tty, raw mode and
+ * closed file descriptors, and that the spawn flags are honoured.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/wait.h>
+
+#include "miniexpect.h"
+#include "tests.h"
+
+static pcre2_code *yes_re, *no_re;
+static pcre2_match_data *match_data;
+
+/* Run 'sh -c cmd' and return which of "yes" or "no" it printed. */
+static int
+run (unsigned flags, const char *cmd)
+{
+  mexp_h *h;
+  int r, status;
+
+  h = mexp_spawnlf (flags, "sh", "sh", "-c", cmd, NULL);
+  assert (h != NULL);
+  r = mexp_expect (h,
+                   (mexp_regexp[]) {
+                     { 100, yes_re, 0 },
+                     { 101, no_re, 0 },
+                     { 0 },
+                   }, match_data);
+  status = mexp_close (h);
+  if (status != 0 && !test_is_sighup (status)) {
+    fprintf (stderr, "%s: non-zero exit status from subcommand: ", cmd);
+    test_diagnose (status);
+    fprintf (stderr, "\n");
+    exit (EXIT_FAILURE);
+  }
+  return r;
+}
+
+int
+main (int argc __attribute__ ((unused)),
+      char *argv[] __attribute__ ((unused)))
+{
+  mexp_h *h;
+  int fds[2];
+  char cmd[256];
+  int r, status;
+
+  yes_re = test_compile_re ("yes");
+  no_re = test_compile_re ("no");
+  match_data = pcre2_match_data_create (4, NULL);
+
+  /* The pty must be the controlling terminal, in its own session. */
+  assert (run (0, "exec 3</dev/tty && echo yes || echo no") == 100);
+  snprintf (cmd, sizeof cmd,
+            "test \"$(ps -o sid= -p $$)\" -ne %d && echo yes || echo no",
+            (int) getsid (0));
+  assert (run (0, cmd) == 100);
+
+  /* Raw mode unless MEXP_SPAWN_COOKED_MODE. */
+  assert (run (0, "stty -a | grep -q -- -icanon && echo yes || echo no")
+          == 100);
+  assert (run (MEXP_SPAWN_COOKED_MODE,
+               "stty -a | grep -q -- -icanon && echo yes || echo no")
+          == 101);
+
+  /* File descriptors are closed unless MEXP_SPAWN_KEEP_FDS. */
+  if (pipe (fds) == -1) {
+    perror ("pipe");
+    exit (EXIT_FAILURE);
+  }
+  snprintf (cmd, sizeof cmd,
+            "test -e /proc/$$/fd/%d && echo yes || echo no", fds[1]);
+  assert (run (0, cmd) == 101);
+  assert (run (MEXP_SPAWN_KEEP_FDS, cmd) == 100);
+  close (fds[0]);
+  close (fds[1]);
+
+  /* A program which doesn't exist still gives a handle, and the
+   * subprocess exits with an error.
+   */
+  h = mexp_spawnl ("/nonexistent", "/nonexistent", NULL);
+  assert (h != NULL);
+  r = mexp_expect (h, (mexp_regexp[]) { { 0 } }, NULL);
+  assert (r == MEXP_EOF);
+  status = mexp_close (h);
+  assert (WIFEXITED (status) && WEXITSTATUS (status) == EXIT_FAILURE);
+
+  pcre2_code_free (yes_re);
+  pcre2_code_free (no_re);
+  pcre2_match_data_free (match_data);
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,127 @@
+/* miniexpect test suite
+ * Copyright (C) 2014-2022 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test the performance counters and time-to-match histograms. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "miniexpect.h"
+#include "tests.h"
+
+static const struct mexp_histogram *
+find_histogram (mexp_h *h, int r)
+{
+  const struct mexp_histogram *hist;
+  size_t i, nr;
+
+  hist = mexp_get_histograms (h, &nr);
+  for (i = 0; i < nr; ++i)
+    if (hist[i].r == r)
+      return &hist[i];
+  return NULL;
+}
+
+int
+main (int argc __attribute__ ((unused)), char *argv[])
+{
+  mexp_h *h;
+  int status, r, i;
+  struct mexp_stats stats;
+  const struct mexp_histogram *hist;
+  uint64_t count;
+  size_t nr;
+  pcre2_code *hello_re = test_compile_re ("hello");
+  pcre2_code *world_re = test_compile_re ("world");
+  pcre2_match_data *match_data = pcre2_match_data_create (4, NULL);
+  const mexp_regexp regexps[] = {
+    { 100, .re = hello_re },
+    { 101, .re = world_re },
+    { 0 },
+  };
+
+  h = mexp_spawnl ("sh", "sh", "-c", "echo hello; sleep 0.2; echo world",
+                   NULL);
+  assert (h != NULL);
+
+  mexp_get_stats (h, &stats);
+  assert (stats.expects == 0);
+  assert (stats.bytes_read == 0);
+  assert (mexp_get_histograms (h, &nr) == NULL || nr == 0);
+
+  r = mexp_expect (h, regexps, match_data);
+  assert (r == 100);
+  r = mexp_expect (h, regexps, match_data);
+  assert (r == 101);
+  r = mexp_expect (h, regexps, match_data);
+  assert (r == MEXP_EOF);
+
+  mexp_get_stats (h, &stats);
+  assert (stats.expects == 3);
+  assert (stats.reads >= 3);
+  assert (stats.wakeups >= 3);
+  /* "hello\r\nworld\r\n" perhaps without the \r's. */
+  assert (stats.bytes_read >= 12);
+  assert (stats.matches >= 2);
+  assert (stats.buffer_high_water > 0);
+  assert (stats.buffer_high_water <= h->alloc);
+
+  /* One histogram for each result. */
+  mexp_get_histograms (h, &nr);
+  assert (nr == 3);
+  assert (find_histogram (h, 100)->count == 1);
+  assert (find_histogram (h, MEXP_EOF)->count == 1);
+
+  /* Waiting for "world" took about 200ms, which is in the bucket for
+   * 2^17 to 2^18 microseconds.
+   */
+  hist = find_histogram (h, 101);
+  assert (hist->count == 1);
+  assert (hist->max_ns >= 150000000);
+  assert (hist->total_ns == hist->max_ns);
+  count = 0;
+  for (i = 17; i < MEXP_HISTOGRAM_BUCKETS; ++i)
+    count += hist->buckets[i];
+  assert (count == 1);
+
+  mexp_reset_stats (h);
+  mexp_get_stats (h, &stats);
+  assert (stats.expects == 0);
+  assert (stats.match_ns == 0);
+  mexp_get_histograms (h, &nr);
+  assert (nr == 0);
+
+  status = mexp_close (h);
+  if (status != 0 && !test_is_sighup (status)) {
+    fprintf (stderr, "%s: non-zero exit status from subcommand: ", argv[0]);
+    test_diagnose (status);
+    fprintf (stderr, "\n");
+    exit (EXIT_FAILURE);
+  }
+
+  pcre2_code_free (hello_re);
+  pcre2_code_free (world_re);
+  pcre2_match_data_free (match_data);
+
+  exit (EXIT_SUCCESS);
+}
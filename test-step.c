@@ -0,0 +1,180 @@
+/* miniexpect test suite
+ * Copyright (C) 2014-2022 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test the non-blocking mexp_expect_start / mexp_expect_step API,
+ * driven by a poll loop as an event loop would.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <poll.h>
+#include <assert.h>
+
+#include "miniexpect.h"
+#include "tests.h"
+
+/* Run an event loop for a single handle until there is a result. */
+static int
+run_loop (mexp_h *h, int r, int *steps)
+{
+  struct pollfd pfds[1];
+
+  *steps = 0;
+  while (r == MEXP_AGAIN) {
+    pfds[0].fd = mexp_get_fd (h);
+    pfds[0].events = POLLIN;
+    pfds[0].revents = 0;
+    if (poll (pfds, 1, mexp_expect_timeout_ms (h)) == -1) {
+      perror ("poll");
+      exit (EXIT_FAILURE);
+    }
+    r = mexp_expect_step (h);
+    (*steps)++;
+  }
+  return r;
+}
+
+static void
+close_handle (mexp_h *h, const char *prog)
+{
+  int status;
+
+  status = mexp_close (h);
+  if (status != 0 && !test_is_sighup (status)) {
+    fprintf (stderr, "%s: non-zero exit status from subcommand: ", prog);
+    test_diagnose (status);
+    fprintf (stderr, "\n");
+    exit (EXIT_FAILURE);
+  }
+}
+
+int
+main (int argc __attribute__ ((unused)), char *argv[])
+{
+  mexp_h *h;
+  int r, steps;
+  struct mexp_stats stats;
+  pcre2_code *hello_re = test_compile_re ("hello");
+  pcre2_code *world_re = test_compile_re ("world");
+  pcre2_match_data *match_data = pcre2_match_data_create (4, NULL);
+
+  h = mexp_spawnl ("sh", "sh", "-c", "sleep 0.2; echo hello; echo world",
+                   NULL);
+  assert (h != NULL);
+
+  /* Not started yet. */
+  assert (mexp_expect_step (h) == MEXP_ERROR);
+  assert (mexp_expect_timeout_ms (h) == -1);
+
+  r = mexp_expect_start (h,
+                         (mexp_regexp[]) {
+                           { 100, .re = hello_re },
+                           { 0 },
+                         }, match_data);
+  assert (r == MEXP_AGAIN);
+  r = mexp_expect_timeout_ms (h);
+  assert (r > 0 && r <= 60000);
+  /* Stepping with no data available doesn't block. */
+  assert (mexp_expect_step (h) == MEXP_AGAIN);
+  r = run_loop (h, MEXP_AGAIN, &steps);
+  assert (r == 100);
+
+  /* The rest of the output is kept, as with mexp_expect. */
+  r = mexp_expect_start (h,
+                         (mexp_regexp[]) {
+                           { 101, .re = world_re },
+                           { 0 },
+                         }, match_data);
+  r = run_loop (h, r, &steps);
+  assert (r == 101);
+  r = mexp_expect_start (h, (mexp_regexp[]) { { 0 } }, NULL);
+  r = run_loop (h, r, &steps);
+  assert (r == MEXP_EOF);
+  close_handle (h, argv[0]);
+
+  /* The blocking calls still work on the non-blocking fd. */
+  h = mexp_spawnl ("cat", "cat", NULL);
+  assert (h != NULL);
+  r = mexp_expect_start (h,
+                         (mexp_regexp[]) {
+                           { 100, .re = hello_re },
+                           { 0 },
+                         }, match_data);
+  assert (r == MEXP_AGAIN);
+  assert (mexp_printf (h, "hello\n") == 6);
+  r = run_loop (h, r, &steps);
+  assert (r == 100);
+  assert (mexp_printf (h, "world\n") == 6);
+  r = mexp_expect (h,
+                   (mexp_regexp[]) {
+                     { 101, .re = world_re },
+                     { 0 },
+                   }, match_data);
+  assert (r == 101);
+  close_handle (h, argv[0]);
+
+  /* Timeouts. */
+  h = mexp_spawnl ("sleep", "sleep", "10", NULL);
+  assert (h != NULL);
+  mexp_set_timeout_ms (h, 100);
+  r = mexp_expect_start (h,
+                         (mexp_regexp[]) {
+                           { 100, .re = hello_re },
+                           { 0 },
+                         }, match_data);
+  r = run_loop (h, r, &steps);
+  assert (r == MEXP_TIMEOUT);
+  assert (steps >= 1);
+  assert (mexp_expect_timeout_ms (h) == -1);
+  close_handle (h, argv[0]);
+
+  /* A subprocess which never stops writing can't keep a step from
+   * returning, and the expect still times out.
+   */
+  h = mexp_spawnl ("yes", "yes", NULL);
+  assert (h != NULL);
+  mexp_set_timeout_ms (h, 200);
+  mexp_set_read_size (h, 1);
+  r = mexp_expect_start (h,
+                         (mexp_regexp[]) {
+                           { 100, .re = hello_re },
+                           { 0 },
+                         }, match_data);
+  assert (r == MEXP_AGAIN);
+  /* Let the pty fill up. */
+  usleep (100000);
+  alarm (10);
+  r = mexp_expect_step (h);
+  assert (r == MEXP_AGAIN);
+  mexp_get_stats (h, &stats);
+  assert (stats.reads <= 16);
+  assert (mexp_expect_timeout_ms (h) == 0);
+  r = run_loop (h, r, &steps);
+  alarm (0);
+  assert (r == MEXP_TIMEOUT);
+  mexp_close (h);
+
+  pcre2_code_free (hello_re);
+  pcre2_code_free (world_re);
+  pcre2_match_data_free (match_data);
+
+  exit (EXIT_SUCCESS);
+}
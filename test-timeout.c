@@ -0,0 +1,161 @@
+/* miniexpect test suite
+ * Copyright (C) 2014-2022 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test timeouts and deadlines. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <assert.h>
+
+#include "miniexpect.h"
+#include "tests.h"
+
+static long
+elapsed_ms (const struct timespec *start)
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000 +
+    (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static void
+close_handle (mexp_h *h, const char *prog)
+{
+  int status;
+
+  status = mexp_close (h);
+  if (status != 0 && !test_is_sighup (status)) {
+    fprintf (stderr, "%s: non-zero exit status from subcommand: ", prog);
+    test_diagnose (status);
+    fprintf (stderr, "\n");
+    exit (EXIT_FAILURE);
+  }
+}
+
+/* Make each read slow, so the subprocess always has more data
+ * waiting than we have read.
+ */
+static void
+slow_read (mexp_h *h __attribute__ ((unused)),
+           const struct mexp_log_event *event,
+           void *opaque __attribute__ ((unused)))
+{
+  if (event->type == MEXP_LOG_READ)
+    usleep (20000);
+}
+
+int
+main (int argc __attribute__ ((unused)), char *argv[])
+{
+  mexp_h *h;
+  int r;
+  long ms;
+  struct timespec start;
+  pcre2_code *done_re = test_compile_re ("done");
+  pcre2_match_data *match_data = pcre2_match_data_create (4, NULL);
+
+  /* The timeout must not expire early. */
+  h = mexp_spawnl ("sleep", "sleep", "10", NULL);
+  assert (h != NULL);
+  mexp_set_timeout_ms (h, 200);
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  r = mexp_expect (h,
+                   (mexp_regexp[]) {
+                     { 100, .re = done_re },
+                     { 0 },
+                   }, match_data);
+  ms = elapsed_ms (&start);
+  assert (r == MEXP_TIMEOUT);
+  assert (ms >= 200 && ms < 2000);
+  close_handle (h, argv[0]);
+
+  /* The deadline is shared between calls to mexp_expect. */
+  h = mexp_spawnl ("sleep", "sleep", "10", NULL);
+  assert (h != NULL);
+  mexp_set_timeout_ms (h, -1);
+  assert (mexp_get_deadline_ms (h) == -1);
+  mexp_set_deadline_ms (h, 300);
+  ms = mexp_get_deadline_ms (h);
+  assert (ms > 0 && ms <= 300);
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  r = mexp_expect (h,
+                   (mexp_regexp[]) {
+                     { 100, .re = done_re },
+                     { 0 },
+                   }, match_data);
+  ms = elapsed_ms (&start);
+  assert (r == MEXP_TIMEOUT);
+  assert (ms >= 290 && ms < 2000);
+  assert (mexp_get_deadline_ms (h) == 0);
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  r = mexp_expect (h,
+                   (mexp_regexp[]) {
+                     { 100, .re = done_re },
+                     { 0 },
+                   }, match_data);
+  ms = elapsed_ms (&start);
+  assert (r == MEXP_TIMEOUT);
+  assert (ms < 100);
+  close_handle (h, argv[0]);
+
+  /* A subprocess which never stops writing can't hold off the
+   * deadline.
+   */
+  h = mexp_spawnl ("yes", "yes", NULL);
+  assert (h != NULL);
+  mexp_set_timeout_ms (h, -1);
+  mexp_set_deadline_ms (h, 200);
+  mexp_set_read_size (h, 1);
+  mexp_set_log_callback (h, slow_read, NULL);
+  alarm (10);
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  r = mexp_expect (h,
+                   (mexp_regexp[]) {
+                     { 100, .re = done_re },
+                     { 0 },
+                   }, match_data);
+  ms = elapsed_ms (&start);
+  alarm (0);
+  assert (r == MEXP_TIMEOUT);
+  assert (ms >= 190 && ms < 2000);
+  mexp_close (h);
+
+  /* A timeout of -1 means wait for ever. */
+  h = mexp_spawnl ("sh", "sh", "-c", "sleep 0.3; echo done", NULL);
+  assert (h != NULL);
+  mexp_set_timeout_ms (h, -1);
+  r = mexp_expect (h,
+                   (mexp_regexp[]) {
+                     { 100, .re = done_re },
+                     { 0 },
+                   }, match_data);
+  assert (r == 100);
+  close_handle (h, argv[0]);
+
+  pcre2_code_free (done_re);
+  pcre2_match_data_free (match_data);
+
+  exit (EXIT_SUCCESS);
+}